@@ -18,6 +18,7 @@
  */
 #include "global.h"
 #include "client.h"
+#include "client_config.h"
 #include "util.h"
 
 #include <errno.h>
@@ -28,6 +29,9 @@
 #include <netdb.h>
 #include <syslog.h>
 
+/// Maximum number of commands sent in one callibration batch
+#define MAX_CALLIBRATION_COMMANDS 64
+
 bool fetch_callibration_data(const char *host, char *response, size_t length)
 {
   // Resolve hostname.
@@ -178,6 +182,9 @@ bool start_callibrator(ucl_object_t *config, int log_option)
       }
 
       // Tokenize string by spaces.
+      char commands[MAX_CALLIBRATION_COMMANDS][256];
+      const char *batch[MAX_CALLIBRATION_COMMANDS];
+      size_t count = 0;
       char *token = NULL;
       char *tmp;
       int index;
@@ -199,27 +206,43 @@ bool start_callibrator(ucl_object_t *config, int log_option)
           continue;
         }
 
+        if (count == MAX_CALLIBRATION_COMMANDS) {
+          syslog(LOG_WARNING, "Too many callibration commands, ignoring token %d.", index);
+          continue;
+        }
+
         // If there is a newline at the end of the token, strip it.
         if (token[strlen(token) - 1] == '\n')
           token[strlen(token) - 1] = 0;
 
-        // Execute callibration command locally.
-        char *response;
-        char command[256] = {0,};
-        snprintf(command, sizeof(command), callibration_command, token);
-        if (!client_send_device_command(client_fd, command, &response)) {
-          syslog(LOG_WARNING, "Failed to communicate with the control daeamon!");
-
-          if (++cmd_failures > 5) {
-            syslog(LOG_ERR, "Multiple failures while recallibrating, reconnecting...");
-            close(client_fd);
-            client_fd = client_connect(cfg_server);
-            cmd_failures = 0;
-          }
-          continue;
+        snprintf(commands[count], sizeof(commands[count]), callibration_command, token);
+        batch[count] = commands[count];
+        count++;
+      }
+
+      if (count == 0)
+        continue;
+
+      // Execute all callibration commands locally in a single round trip.
+      char *responses[MAX_CALLIBRATION_COMMANDS];
+      bool results[MAX_CALLIBRATION_COMMANDS];
+      if (!client_send_device_commands(client_fd, batch, count, responses, results)) {
+        syslog(LOG_WARNING, "Failed to communicate with the control daeamon!");
+
+        if (++cmd_failures > 5) {
+          syslog(LOG_ERR, "Multiple failures while recallibrating, reconnecting...");
+          close(client_fd);
+          client_fd = client_connect(cfg_server);
+          cmd_failures = 0;
         }
+        continue;
+      }
 
-        free(response);
+      size_t i;
+      for (i = 0; i < count; i++) {
+        if (!results[i])
+          syslog(LOG_WARNING, "Callibration command failed: %s", batch[i]);
+        free(responses[i]);
       }
     }
   }
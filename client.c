@@ -18,21 +18,33 @@
  */
 #include "global.h"
 #include "client.h"
+#include "framer.h"
+#include "protocol.h"
 #include "util.h"
 
 #include <termios.h>
+#include <ctype.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <signal.h>
 
+/// Identifier of the last binary request
+uint32_t client_last_id = 0;
+
 /**
  * Establishes a connection with the control server.
  *
- * @param cfg_server Server configuration object
+ * @param socket_path Path to the server's UNIX socket
  * @return Socket file descriptor
  */
-int client_connect(const ucl_object_t *cfg_server)
+int client_connect_path(const char *socket_path)
 {
   // Install signal handlers
   signal(SIGPIPE, SIG_IGN);
@@ -41,17 +53,6 @@ int client_connect(const ucl_object_t *cfg_server)
   struct sockaddr_un address;
   memset(&address, 0, sizeof(address));
   address.sun_family = AF_UNIX;
-
-  const ucl_object_t *obj = ucl_object_find_key(cfg_server, "socket");
-  const char *socket_path;
-  if (!obj) {
-    fprintf(stderr, "ERROR: Missing 'socket' in configuration file!\n");
-    return -1;
-  } else if (!ucl_object_tostring_safe(obj, &socket_path)) {
-    fprintf(stderr, "ERROR: Socket path must be a string!\n");
-    return -1;
-  }
-
   strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
 
   int client_fd;
@@ -68,6 +69,411 @@ int client_connect(const ucl_object_t *cfg_server)
   return client_fd;
 }
 
+struct client_reader_t {
+  /// Connection to server file descriptor
+  int fd;
+  /// Receive buffer
+  char buffer[4096];
+  /// Start of unprocessed data
+  size_t start;
+  /// End of received data
+  size_t end;
+  /// Amount of received data already removed from the socket
+  size_t consumed;
+  /// Time after which reads fail (msec, 0 if none)
+  utimer_t deadline;
+};
+
+/**
+ * Initializes a buffered reader.
+ *
+ * @param reader Reader state
+ * @param client_fd Connection to server file descriptor
+ * @param deadline Time after which reads fail (msec, 0 if none)
+ */
+void client_reader_init(struct client_reader_t *reader, int client_fd, utimer_t deadline)
+{
+  reader->fd = client_fd;
+  reader->start = 0;
+  reader->end = 0;
+  reader->consumed = 0;
+  reader->deadline = deadline;
+}
+
+/**
+ * Waits until data can be read from the server or the reader's deadline
+ * expires. On expiry errno is set to ETIMEDOUT.
+ *
+ * @param reader Reader state
+ * @return True when data can be read, false when some error has ocurred
+ */
+bool client_reader_wait(struct client_reader_t *reader)
+{
+  if (reader->deadline == 0)
+    return true;
+
+  for (;;) {
+    utimer_t now = timer_now();
+    if (now >= reader->deadline) {
+      fprintf(stderr, "ERROR: Timed out waiting for server!\n");
+      errno = ETIMEDOUT;
+      return false;
+    }
+
+    struct pollfd pfd = { reader->fd, POLLIN, 0 };
+    int n = poll(&pfd, 1, (int) (reader->deadline - now));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      fprintf(stderr, "ERROR: Failed to wait for server!\n");
+      fprintf(stderr, "ERROR: %s (%d)!\n", strerror(errno), errno);
+      return false;
+    } else if (n > 0) {
+      return true;
+    }
+  }
+}
+
+/**
+ * Removes received data up to the given buffer offset from the socket.
+ * Data is only peeked at while it is being parsed, so that anything
+ * following the response stays in the socket for the next call.
+ *
+ * @param reader Reader state
+ * @param offset Buffer offset
+ * @return True on success, false when some error has ocurred
+ */
+bool client_reader_consume(struct client_reader_t *reader, size_t offset)
+{
+  while (reader->consumed < offset) {
+    // Consumed data is identical to the peeked data already in the buffer
+    ssize_t n = recv(reader->fd, reader->buffer + reader->consumed, offset - reader->consumed, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      fprintf(stderr, "ERROR: Failed to read from server!\n");
+      return false;
+    }
+
+    reader->consumed += n;
+  }
+
+  return true;
+}
+
+/**
+ * Reads the next line from the server. Data is read in chunks as large
+ * as the receive buffer permits and lines are split in place. Lines that
+ * do not fit into the receive buffer are returned in multiple parts,
+ * where only the last part ends with a newline. The returned line is
+ * not NUL-terminated and is only valid until the next call. Call
+ * client_reader_finish() after the last line to remove it from the
+ * socket.
+ *
+ * @param reader Reader state
+ * @param line Output pointer to the start of line
+ * @return Length of line including the newline, 0 when the connection
+ *   was closed, -1 when some error has ocurred
+ */
+ssize_t client_read_line(struct client_reader_t *reader, char **line)
+{
+  for (;;) {
+    char *data = reader->buffer + reader->start;
+    char *eol = memchr(data, '\n', reader->end - reader->start);
+    if (eol) {
+      *line = data;
+      reader->start += eol - data + 1;
+      return eol - data + 1;
+    }
+
+    // Remove everything peeked so far, so that the next peek waits for new data
+    if (!client_reader_consume(reader, reader->end))
+      return -1;
+
+    // Move partial line to the start of buffer to make room
+    if (reader->start > 0) {
+      memmove(reader->buffer, data, reader->end - reader->start);
+      reader->end -= reader->start;
+      reader->consumed = reader->end;
+      reader->start = 0;
+    }
+
+    if (reader->end == sizeof(reader->buffer)) {
+      // Return part of a long line, keeping a trailing carriage return with the newline
+      size_t length = reader->end;
+      if (reader->buffer[length - 1] == '\r')
+        length--;
+
+      *line = reader->buffer;
+      reader->start = length;
+      return length;
+    }
+
+    if (!client_reader_wait(reader))
+      return -1;
+
+    ssize_t n = recv(reader->fd, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end, MSG_PEEK);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      fprintf(stderr, "ERROR: Failed to read from server!\n");
+      fprintf(stderr, "ERROR: %s (%d)!\n", strerror(errno), errno);
+      return -1;
+    } else if (n == 0) {
+      fprintf(stderr, "ERROR: Connection closed by server!\n");
+      return 0;
+    }
+
+    reader->end += n;
+  }
+}
+
+/**
+ * Removes all lines returned so far from the socket.
+ *
+ * @param reader Reader state
+ * @return True on success, false when some error has ocurred
+ */
+bool client_reader_finish(struct client_reader_t *reader)
+{
+  return client_reader_consume(reader, reader->start);
+}
+
+/**
+ * Reads response frames from the server until a frame of the requested
+ * kind has been received, passing each of its lines to the callback as
+ * soon as they arrive. Frames published to subscribers are preceded by
+ * a line naming the topic. Frames of the other kind are skipped.
+ * Memory use does not depend on the size of the response.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param push True to wait for a publication, false for a response
+ * @param deadline Time after which reading fails (msec, 0 if none)
+ * @param topic Output buffer for the topic name (can be NULL)
+ * @param topic_size Size of topic name buffer
+ * @param callback Callback invoked for each response line
+ * @param arg Callback argument
+ * @param error Output flag set for error responses (when NULL, error
+ *   responses are reported as failures)
+ * @return True on success, false when some error has ocurred
+ */
+bool client_stream_response(int client_fd,
+                            bool push,
+                            utimer_t deadline,
+                            char *topic,
+                            size_t topic_size,
+                            client_line_cb callback,
+                            void *arg,
+                            bool *error)
+{
+  struct client_reader_t reader;
+  client_reader_init(&reader, client_fd, deadline);
+
+  for (;;) {
+    bool result = true;
+    bool is_push = false;
+    bool first = true;
+    bool line_start = true;
+    struct framer_t framer;
+    framer_init(&framer);
+    for (;;) {
+      char *buffer;
+      ssize_t buffer_size = client_read_line(&reader, &buffer);
+      if (buffer_size <= 0)
+        return false;
+
+      enum framer_event_t event;
+      framer_feed_buffer(&framer, buffer, buffer_size, &event);
+
+      bool starts_line = line_start;
+      line_start = buffer[buffer_size - 1] == '\n';
+
+      // Normalize line ending
+      if (buffer_size > 1 && buffer[buffer_size - 2] == '\r' && line_start) {
+        buffer[buffer_size - 2] = '\n';
+        buffer_size--;
+      }
+
+      DEBUG_LOG("DEBUG: Got response line: %.*s", (int) buffer_size, buffer);
+
+      if (event == FRAMER_EVENT_START) {
+        DEBUG_LOG("DEBUG: Detected start message.\n");
+        continue;
+      } else if (event == FRAMER_EVENT_ERROR) {
+        DEBUG_LOG("DEBUG: Detected error message.\n");
+        result = false;
+        continue;
+      } else if (event == FRAMER_EVENT_STOP) {
+        DEBUG_LOG("DEBUG: Detected stop message.\n");
+        break;
+      }
+
+      if (!framer.header) {
+        if (first && starts_line && line_start && buffer_size > 6 && strncmp(buffer, "#PUSH ", 6) == 0) {
+          DEBUG_LOG("DEBUG: Detected push message.\n");
+          is_push = true;
+          if (push && topic && topic_size > 0) {
+            size_t length = buffer_size - 7;
+            if (length >= topic_size)
+              length = topic_size - 1;
+            memcpy(topic, buffer + 6, length);
+            topic[length] = 0;
+          }
+          first = false;
+          continue;
+        }
+
+        first = false;
+        fprintf(stderr, "WARNING: Received response line before header start:\n");
+        fprintf(stderr, "WARNING: %.*s", (int) buffer_size, buffer);
+        continue;
+      }
+
+      if (is_push == push)
+        callback(buffer, buffer_size, arg);
+    }
+
+    // Errors are also reported while waiting for publications
+    if (is_push == push || (push && !result)) {
+      if (!client_reader_finish(&reader))
+        return false;
+
+      if (error) {
+        *error = !result;
+        return true;
+      }
+
+      return result;
+    }
+
+    if (push)
+      DEBUG_LOG("DEBUG: Skipping command response.\n");
+    else
+      DEBUG_LOG("DEBUG: Skipping published message.\n");
+  }
+}
+
+/**
+ * Sends a command to the server without waiting for the response.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param command Command string to send
+ * @return True on success, false when some error has ocurred
+ */
+bool client_write_command(int client_fd, const char *command)
+{
+  DEBUG_LOG("DEBUG: Sending command: %s", command);
+
+  // Request status data from the device
+  if (write(client_fd, command, strlen(command)) < 0) {
+    fprintf(stderr, "ERROR: Failed to send command to server!\n");
+    fprintf(stderr, "ERROR: %s (%d)!\n", strerror(errno), errno);
+    return false;
+  }
+
+  DEBUG_LOG("DEBUG: Waiting for response from server.\n");
+  return true;
+}
+
+/**
+ * Sends a command to the server and passes each line of the response
+ * to the callback as soon as it arrives. There is no limit on the size
+ * of the response. Lines longer than 4096 bytes are passed in multiple
+ * parts, where only the last part ends with a newline.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param command Command string to send
+ * @param callback Callback invoked for each response line
+ * @param arg Callback argument
+ * @return True on success, false when some error has ocurred
+ */
+bool client_send_streaming_command(int client_fd, const char *command, client_line_cb callback, void *arg)
+{
+  if (!client_write_command(client_fd, command))
+    return false;
+
+  return client_stream_response(client_fd, false, 0, NULL, 0, callback, arg, NULL);
+}
+
+struct client_buffer_t {
+  /// Buffer data (NUL-terminated)
+  char *data;
+  /// Length of data
+  size_t size;
+  /// Allocated size
+  size_t capacity;
+  /// Allocation has failed
+  bool failed;
+};
+
+/**
+ * Line callback that appends response lines into a buffer.
+ *
+ * @param line Response line
+ * @param length Line length
+ * @param arg Buffer
+ */
+void client_buffer_append_cb(const char *line, size_t length, void *arg)
+{
+  struct client_buffer_t *buffer = (struct client_buffer_t*) arg;
+  if (buffer->failed)
+    return;
+
+  if (buffer->size + length + 1 > buffer->capacity) {
+    // Grow response buffer geometrically
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    while (capacity < buffer->size + length + 1)
+      capacity *= 2;
+
+    char *tmp = realloc(buffer->data, capacity);
+    if (!tmp) {
+      fprintf(stderr, "ERROR: Failed to allocate response buffer!\n");
+      buffer->failed = true;
+      return;
+    }
+
+    buffer->data = tmp;
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->data + buffer->size, line, length);
+  buffer->size += length;
+  buffer->data[buffer->size] = 0;
+}
+
+/**
+ * Reads a single response frame of the requested kind from the server
+ * into a buffer. The output response buffer will be allocated by this
+ * method and must be freed by the caller. In case of an error, the
+ * output buffer will be NULL.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param push True to wait for a publication, false for a response
+ * @param deadline Time after which reading fails (msec, 0 if none)
+ * @param topic Output buffer for the topic name (can be NULL)
+ * @param topic_size Size of topic name buffer
+ * @param response Output buffer where the response will be stored
+ * @return True on success, false when some error has ocurred
+ */
+bool client_read_response(int client_fd,
+                          bool push,
+                          utimer_t deadline,
+                          char *topic,
+                          size_t topic_size,
+                          char **response)
+{
+  struct client_buffer_t buffer = { NULL, 0, 0, false };
+  if (!client_stream_response(client_fd, push, deadline, topic, topic_size, client_buffer_append_cb, &buffer, NULL) ||
+      buffer.failed) {
+    free(buffer.data);
+    *response = NULL;
+    return false;
+  }
+
+  *response = buffer.data;
+  return true;
+}
+
 /**
  * Sends a command to the server and parses the response. The output
  * response buffer will be allocated by this method and must be freed
@@ -80,100 +486,597 @@ int client_connect(const ucl_object_t *cfg_server)
  */
 bool client_send_device_command(int client_fd, const char *command, char **response)
 {
-  // Initialize response buffer
   *response = NULL;
+  if (!client_write_command(client_fd, command))
+    return false;
 
-  DEBUG_LOG("DEBUG: Sending command: %s", command);
+  return client_read_response(client_fd, false, 0, NULL, 0, response);
+}
 
-  // Request status data from the device
-  if (write(client_fd, command, strlen(command)) < 0) {
-    fprintf(stderr, "ERROR: Failed to send command to server!\n");
-    fprintf(stderr, "ERROR: %s (%d)!\n", strerror(errno), errno);
+/**
+ * Sends multiple commands to the server in a single write and collects
+ * their responses in order, so that all commands take one round trip
+ * instead of one each. Each output response buffer will be allocated by
+ * this method and must be freed by the caller. The response buffer of a
+ * failed command is NULL. In case of an error, all output buffers are
+ * NULL.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param commands Command strings to send
+ * @param count Number of commands
+ * @param responses Output array where the responses will be stored
+ * @param results Output array of per-command success flags
+ * @return True when all responses have been received, false when some
+ *   error has ocurred
+ */
+bool client_send_device_commands(int client_fd,
+                                 const char **commands,
+                                 size_t count,
+                                 char **responses,
+                                 bool *results)
+{
+  size_t i, length = 0;
+  for (i = 0; i < count; i++) {
+    responses[i] = NULL;
+    results[i] = false;
+    length += strlen(commands[i]);
+  }
+
+  char *request = (char*) malloc(length + 1);
+  if (!request) {
+    fprintf(stderr, "ERROR: Failed to allocate request buffer!\n");
     return false;
   }
 
-  DEBUG_LOG("DEBUG: Waiting for response from server.\n");
+  length = 0;
+  for (i = 0; i < count; i++) {
+    size_t cmd_length = strlen(commands[i]);
+    memcpy(request + length, commands[i], cmd_length);
+    length += cmd_length;
+  }
+  request[length] = 0;
 
-  // Parse response from device
-#define MAX_RESPONSE_LINES 128
-  bool result = true;
-  char buffer[4096];
-  int line;
-  char *buffer_p = (char*) buffer;
-  size_t buffer_size = 0;
-  size_t response_size = 0;
-  bool received_header = false;
-  memset(buffer, 0, sizeof(buffer));
-  for (line = 0; line < MAX_RESPONSE_LINES;) {
-    if (buffer_size >= sizeof(buffer)) {
-      fprintf(stderr, "ERROR: Response line longer than %ld bytes!\n", sizeof(buffer));
-
-      free(*response);
-      *response = NULL;
+  bool sent = client_write_command(client_fd, request);
+  free(request);
+  if (!sent)
+    return false;
+
+  for (i = 0; i < count; i++) {
+    struct client_buffer_t buffer = { NULL, 0, 0, false };
+    bool error;
+    if (!client_stream_response(client_fd, false, 0, NULL, 0, client_buffer_append_cb, &buffer, &error)) {
+      free(buffer.data);
+      while (i > 0) {
+        free(responses[--i]);
+        responses[i] = NULL;
+      }
       return false;
     }
 
-    if (read(client_fd, buffer_p + buffer_size, 1) < 0) {
-      fprintf(stderr, "ERROR: Failed to read from server!\n");
-      fprintf(stderr, "ERROR: %s (%d)!\n", strerror(errno), errno);
+    results[i] = !error && !buffer.failed;
+    if (results[i])
+      responses[i] = buffer.data;
+    else
+      free(buffer.data);
+  }
+
+  return true;
+}
+
+/**
+ * Line callback that ignores response lines.
+ *
+ * @param line Response line
+ * @param length Line length
+ * @param arg Unused
+ */
+void client_discard_cb(const char *line, size_t length, void *arg)
+{
+}
+
+/**
+ * Checks whether the server handles a verb itself. Servers that do not
+ * know the PROTOCOL verb pass it on to the device, which does not list
+ * any verbs in its response.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param verb Verb name
+ * @return True if the server supports the verb
+ */
+bool client_server_supports(int client_fd, const char *verb)
+{
+  if (!client_write_command(client_fd, "PROTOCOL\n"))
+    return false;
+
+  struct client_buffer_t buffer = { NULL, 0, 0, false };
+  bool error;
+  if (!client_stream_response(client_fd, false, 0, NULL, 0, client_buffer_append_cb, &buffer, &error) ||
+      error || buffer.failed || !buffer.data) {
+    free(buffer.data);
+    return false;
+  }
+
+  bool supported = false;
+  char *line = buffer.data;
+  while (line && !supported) {
+    char *eol = strchr(line, '\n');
+    if (eol)
+      *eol = 0;
+
+    if (strncmp(line, "verbs:", 6) == 0) {
+      char *name, *saveptr;
+      for (name = strtok_r(line + 6, " ", &saveptr); name != NULL; name = strtok_r(NULL, " ", &saveptr)) {
+        if (strcmp(name, verb) == 0) {
+          supported = true;
+          break;
+        }
+      }
+    }
+
+    line = eol ? eol + 1 : NULL;
+  }
 
-      free(*response);
-      *response = NULL;
+  free(buffer.data);
+  return supported;
+}
+
+/**
+ * Sends a command to the server and parses the response, giving up
+ * once the timeout expires. As the response may still arrive later,
+ * the connection must be closed after a timeout, which is indicated by
+ * errno being set to ETIMEDOUT. When the deadline is propagated, the
+ * server drops the command instead of sending it to the device if it
+ * is still queued once nobody waits for the response anymore. The
+ * output response buffer will be allocated by this method and must be
+ * freed by the caller. In case of an error, the output buffer will be
+ * NULL.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param command Command string to send
+ * @param timeout Time to wait for the response (msec, 0 for no limit)
+ * @param propagate Should the deadline be sent to the server, which
+ *   must support the DEADLINE verb (see client_server_supports())
+ * @param response Output buffer where the response will be stored
+ * @return True on success, false when some error has ocurred
+ */
+bool client_send_device_command_timeout(int client_fd,
+                                        const char *command,
+                                        utimer_t timeout,
+                                        bool propagate,
+                                        char **response)
+{
+  *response = NULL;
+  utimer_t deadline = timeout > 0 ? timer_now() + timeout : 0;
+  if (timeout == 0 || !propagate) {
+    if (!client_write_command(client_fd, command))
       return false;
+
+    return client_read_response(client_fd, false, deadline, NULL, 0, response);
+  }
+
+  // Deadline is sent together with the command
+  char request[128];
+  if (snprintf(request, sizeof(request), "DEADLINE %llu\n%s", timeout, command) >= (int) sizeof(request)) {
+    fprintf(stderr, "ERROR: Command too long!\n");
+    return false;
+  }
+
+  if (!client_write_command(client_fd, request))
+    return false;
+
+  // A rejected deadline does not affect the command, which is then
+  // processed without it
+  bool error;
+  if (!client_stream_response(client_fd, false, deadline, NULL, 0, client_discard_cb, NULL, &error))
+    return false;
+  if (error)
+    fprintf(stderr, "WARNING: Deadline rejected by server!\n");
+
+  return client_read_response(client_fd, false, deadline, NULL, 0, response);
+}
+
+/**
+ * Initializes an empty parsed response.
+ *
+ * @param parsed Parsed response
+ */
+void client_response_init(struct client_response_t *parsed)
+{
+  parsed->buffer = NULL;
+  parsed->fields = NULL;
+  parsed->count = 0;
+  parsed->capacity = 0;
+}
+
+/**
+ * Parses a single response line in place.
+ *
+ * @param line Start of line, NUL-terminated
+ * @param eol End of line
+ * @param field Output field
+ * @return True if the line is a valid field, false if it should be
+ *   ignored
+ */
+bool client_parse_field(char *line, char *eol, struct client_field_t *field)
+{
+  char *colon = memchr(line, ':', eol - line);
+  if (!colon || colon == line)
+    return false;
+
+  *colon = 0;
+  field->key = line;
+  field->op = NULL;
+  field->string = NULL;
+
+  char *rest = colon + 1;
+  char *op = rest;
+  while (op < eol && isspace((unsigned char) *op))
+    op++;
+
+  // Value with operator specification
+  char *op_end = memchr(op, ':', eol - op);
+  if (op_end && op_end != op) {
+    char *end;
+    field->value = strtod(op_end + 1, &end);
+    if (end != op_end + 1) {
+      *op_end = 0;
+      field->type = CLIENT_FIELD_VALUE;
+      field->op = op;
+      return true;
+    }
+  }
+
+  // Value without operator specification
+  char *end;
+  field->value = strtod(rest, &end);
+  if (end != rest) {
+    field->type = CLIENT_FIELD_VALUE;
+    return true;
+  }
+
+  // Metadata string
+  if (op == eol)
+    return false;
+
+  field->type = CLIENT_FIELD_METADATA;
+  field->string = op;
+  return true;
+}
+
+/**
+ * Parses a response into fields in a single pass. Each line is either
+ * a value line in the form "<key>: [<op>:] <value>" or a metadata line
+ * in the form "<key>: <string>"; any other lines are ignored. The
+ * response buffer is modified in place and all returned strings point
+ * into it, so no memory is allocated per line.
+ *
+ * The parsed response takes ownership of the buffer, which must have
+ * been allocated with malloc. Any buffer from a previous call is freed,
+ * while the field array is reused.
+ *
+ * @param response Response buffer (can be NULL)
+ * @param parsed Initialized parsed response
+ * @return True on success, false when some error has ocurred
+ */
+bool client_parse_response(char *response, struct client_response_t *parsed)
+{
+  free(parsed->buffer);
+  parsed->buffer = response;
+  parsed->count = 0;
+  if (!response)
+    return true;
+
+  char *line = response;
+  while (*line) {
+    char *eol = strchr(line, '\n');
+    char *next;
+    if (eol) {
+      *eol = 0;
+      next = eol + 1;
     } else {
-      buffer_size++;
+      eol = line + strlen(line);
+      next = eol;
     }
 
-    char last = buffer[buffer_size - 1];
-    if (last == '\r') {
-      buffer[buffer_size - 1] = 0;
-      buffer_size--;
-      continue;
-    } else if (last != '\n') {
-      continue;
+    if (parsed->count == parsed->capacity) {
+      size_t capacity = parsed->capacity ? parsed->capacity * 2 : 32;
+      struct client_field_t *fields = realloc(parsed->fields, capacity * sizeof(struct client_field_t));
+      if (!fields) {
+        fprintf(stderr, "ERROR: Failed to allocate response fields!\n");
+        return false;
+      }
+
+      parsed->fields = fields;
+      parsed->capacity = capacity;
     }
 
-    line++;
+    if (client_parse_field(line, eol, &parsed->fields[parsed->count]))
+      parsed->count++;
 
-    DEBUG_LOG("DEBUG: Got response line: %s", buffer);
+    line = next;
+  }
 
-    if (strncmp(buffer, "#START\n", sizeof(buffer)) == 0) {
-      DEBUG_LOG("DEBUG: Detected start message.\n");
-      memset(buffer, 0, buffer_size);
-      buffer_size = 0;
-      received_header = true;
-      continue;
-    } else if (strncmp(buffer, "#ERROR\n", sizeof(buffer)) == 0) {
-      DEBUG_LOG("DEBUG: Detected error message.\n");
-      memset(buffer, 0, buffer_size);
-      buffer_size = 0;
-      received_header = true;
-      result = false;
+  return true;
+}
+
+/**
+ * Sends a command to the server and parses the response into fields
+ * using client_parse_response().
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param command Command string to send
+ * @param parsed Initialized parsed response
+ * @return True on success, false when some error has ocurred
+ */
+bool client_send_parsed_command(int client_fd, const char *command, struct client_response_t *parsed)
+{
+  char *response;
+  bool result = client_send_device_command(client_fd, command, &response);
+  if (!client_parse_response(response, parsed))
+    return false;
+
+  return result;
+}
+
+/**
+ * Frees a parsed response.
+ *
+ * @param parsed Parsed response
+ */
+void client_response_free(struct client_response_t *parsed)
+{
+  free(parsed->buffer);
+  free(parsed->fields);
+  client_response_init(parsed);
+}
+
+/**
+ * Subscribes the connection to periodic publications of a topic by the
+ * server. Published responses are then received using the
+ * client_receive_push() method.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param topic Topic name
+ * @return True on success, false when some error has ocurred
+ */
+bool client_subscribe(int client_fd, const char *topic)
+{
+  char command[64];
+  snprintf(command, sizeof(command), "SUBSCRIBE %s\n", topic);
+
+  char *response;
+  bool result = client_send_device_command(client_fd, command, &response);
+  free(response);
+  if (!result)
+    fprintf(stderr, "ERROR: Failed to subscribe to topic '%s'!\n", topic);
+
+  return result;
+}
+
+/**
+ * Waits for the next response published to a subscribed topic. The
+ * output response buffer will be allocated by this method and must be
+ * freed by the caller. In case of an error, the output buffer will be
+ * NULL.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param topic Output buffer for the topic name (can be NULL)
+ * @param topic_size Size of topic name buffer
+ * @param response Output buffer where the response will be stored
+ * @return True on success, false when some error has ocurred
+ */
+bool client_receive_push(int client_fd, char *topic, size_t topic_size, char **response)
+{
+  return client_read_response(client_fd, true, 0, topic, topic_size, response);
+}
+
+/**
+ * Switches the connection to binary framing. Afterwards, only the
+ * client_send_binary_command() and client_receive_binary_push() methods
+ * may be used on the connection.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @return True on success, false when some error has ocurred
+ */
+bool client_enable_binary(int client_fd)
+{
+  char *response;
+  bool result = client_send_device_command(client_fd, "PROTOCOL binary\n", &response);
+  free(response);
+  if (!result)
+    fprintf(stderr, "ERROR: Failed to switch to binary framing!\n");
+
+  return result;
+}
+
+/**
+ * Reads exactly the requested amount of data from the server.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param buffer Output buffer
+ * @param length Number of bytes to read
+ * @return True on success, false when some error has ocurred
+ */
+bool client_read_exact(int client_fd, void *buffer, size_t length)
+{
+  size_t offset = 0;
+  while (offset < length) {
+    ssize_t n = recv(client_fd, (char*) buffer + offset, length - offset, MSG_WAITALL);
+    if (n < 0 && errno == EINTR) {
       continue;
-    } else if (strncmp(buffer, "#STOP\n", sizeof(buffer)) == 0) {
-      DEBUG_LOG("DEBUG: Detected stop message.\n");
-      break;
+    } else if (n < 0) {
+      fprintf(stderr, "ERROR: Failed to read from server!\n");
+      fprintf(stderr, "ERROR: %s (%d)!\n", strerror(errno), errno);
+      return false;
+    } else if (n == 0) {
+      fprintf(stderr, "ERROR: Connection closed by server!\n");
+      return false;
     }
 
-    if (!received_header) {
-      fprintf(stderr, "WARNING: Received response line before header start:\n");
-      fprintf(stderr, "WARNING: %s", buffer);
-      memset(buffer, 0, buffer_size);
-      buffer_size = 0;
+    offset += n;
+  }
+
+  return true;
+}
+
+/**
+ * Reads a single binary frame from the server, which takes exactly two
+ * reads as the header announces the payload length. The response body
+ * is returned with line endings normalized like text responses. The
+ * output response buffer will be allocated by this method and must be
+ * freed by the caller. It is NULL when the body is empty or in case of
+ * an error.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param header Output frame header
+ * @param topic Output buffer for the topic name (can be NULL)
+ * @param topic_size Size of topic name buffer
+ * @param response Output buffer where the response will be stored
+ * @return True on success, false when some error has ocurred
+ */
+bool client_read_frame(int client_fd,
+                       struct protocol_header_t *header,
+                       char *topic,
+                       size_t topic_size,
+                       char **response)
+{
+  *response = NULL;
+
+  uint8_t buffer[PROTOCOL_HEADER_SIZE];
+  if (!client_read_exact(client_fd, buffer, sizeof(buffer)))
+    return false;
+
+  protocol_header_decode(header, buffer);
+  if (header->topic_length > header->length || header->length > PROTOCOL_MAX_RESPONSE) {
+    fprintf(stderr, "ERROR: Invalid frame received from server!\n");
+    return false;
+  }
+
+  char *payload = (char*) malloc(header->length + 1);
+  if (!payload) {
+    fprintf(stderr, "ERROR: Failed to allocate response buffer!\n");
+    return false;
+  }
+
+  if (!client_read_exact(client_fd, payload, header->length)) {
+    free(payload);
+    return false;
+  }
+
+  if (topic && topic_size > 0) {
+    size_t length = header->topic_length;
+    if (length >= topic_size)
+      length = topic_size - 1;
+    memcpy(topic, payload, length);
+    topic[length] = 0;
+  }
+
+  // Move body to the start of payload, dropping carriage returns before newlines
+  size_t i, length = 0;
+  for (i = header->topic_length; i < header->length; i++) {
+    if (payload[i] == '\r' && i + 1 < header->length && payload[i + 1] == '\n')
       continue;
-    }
+    payload[length++] = payload[i];
+  }
 
-    size_t offset = response_size;
-    response_size += buffer_size;
-    *response = realloc(*response, response_size + 1);
-    memcpy(*response + offset, buffer, buffer_size);
-    (*response)[response_size] = 0;
+  if (length == 0) {
+    free(payload);
+    return true;
+  }
 
-    memset(buffer, 0, buffer_size);
-    buffer_size = 0;
+  payload[length] = 0;
+  *response = payload;
+  return true;
+}
+
+/**
+ * Sends a command to the server over a connection that uses binary
+ * framing and reads the response. The output response buffer will be
+ * allocated by this method and must be freed by the caller. In case of
+ * an error, the output buffer will be NULL.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param command Command string to send
+ * @param response Output buffer where the response will be stored
+ * @return True on success, false when some error has ocurred
+ */
+bool client_send_binary_command(int client_fd, const char *command, char **response)
+{
+  *response = NULL;
+
+  struct protocol_header_t header;
+  header.id = ++client_last_id;
+  header.status = 0;
+  header.flags = 0;
+  header.topic_length = 0;
+  header.length = strlen(command);
+
+  uint8_t buffer[PROTOCOL_HEADER_SIZE];
+  protocol_header_encode(&header, buffer);
+
+  DEBUG_LOG("DEBUG: Sending command: %s", command);
+
+  // Header and command are sent together
+  struct iovec iov[2] = {
+    { buffer, sizeof(buffer) },
+    { (void*) command, header.length },
+  };
+  if (writev(client_fd, iov, 2) < (ssize_t) (sizeof(buffer) + header.length)) {
+    fprintf(stderr, "ERROR: Failed to send command to server!\n");
+    fprintf(stderr, "ERROR: %s (%d)!\n", strerror(errno), errno);
+    return false;
   }
 
-  return result;
+  uint32_t id = header.id;
+  for (;;) {
+    if (!client_read_frame(client_fd, &header, NULL, 0, response))
+      return false;
+
+    if (!(header.flags & PROTOCOL_FLAG_PUSH))
+      break;
+
+    // Publications to subscribed topics are not responses to this command
+    DEBUG_LOG("DEBUG: Skipping published message.\n");
+    free(*response);
+    *response = NULL;
+  }
+
+  if (header.id != id) {
+    fprintf(stderr, "ERROR: Response to unexpected request received from server!\n");
+    free(*response);
+    *response = NULL;
+    return false;
+  }
+
+  return header.status == PROTOCOL_STATUS_OK;
+}
+
+/**
+ * Waits for the next response published to a subscribed topic over a
+ * connection that uses binary framing. The output response buffer will
+ * be allocated by this method and must be freed by the caller.
+ *
+ * @param client_fd Connection to server file descriptor
+ * @param topic Output buffer for the topic name (can be NULL)
+ * @param topic_size Size of topic name buffer
+ * @param response Output buffer where the response will be stored
+ * @return True on success, false when some error has ocurred
+ */
+bool client_receive_binary_push(int client_fd, char *topic, size_t topic_size, char **response)
+{
+  for (;;) {
+    struct protocol_header_t header;
+    if (!client_read_frame(client_fd, &header, topic, topic_size, response))
+      return false;
+
+    if (header.flags & PROTOCOL_FLAG_PUSH)
+      return header.status == PROTOCOL_STATUS_OK;
+
+    // Responses to earlier commands are not publications
+    DEBUG_LOG("DEBUG: Skipping command response.\n");
+    free(*response);
+    *response = NULL;
+  }
 }
 
 /**
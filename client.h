@@ -19,10 +19,76 @@
 #ifndef KORUZA_CONTROLLER_CLIENT_H
 #define KORUZA_CONTROLLER_CLIENT_H
 
-#include <ucl.h>
+#include <stdbool.h>
+#include <stddef.h>
 
-int client_connect(const ucl_object_t *cfg_server);
+#include "util.h"
+
+enum client_field_type_t {
+  /// Numeric value line in the form "<key>: [<op>:] <value>"
+  CLIENT_FIELD_VALUE = 0,
+  /// Metadata line in the form "<key>: <string>"
+  CLIENT_FIELD_METADATA,
+};
+
+struct client_field_t {
+  /// Field type
+  enum client_field_type_t type;
+  /// Key
+  const char *key;
+  /// Aggregation operator (NULL when not specified)
+  const char *op;
+  /// Numeric value (value fields only)
+  double value;
+  /// String value (metadata fields only)
+  const char *string;
+};
+
+struct client_response_t {
+  /// Response buffer that all fields point into
+  char *buffer;
+  /// Parsed fields in response order
+  struct client_field_t *fields;
+  /// Number of parsed fields
+  size_t count;
+  /// Number of allocated fields
+  size_t capacity;
+};
+
+/**
+ * Callback invoked for each line of a streamed response. The line
+ * includes the newline, is not NUL-terminated and is only valid during
+ * the callback.
+ *
+ * @param line Response line
+ * @param length Line length
+ * @param arg User argument
+ */
+typedef void (*client_line_cb)(const char *line, size_t length, void *arg);
+
+int client_connect_path(const char *socket_path);
 bool client_send_device_command(int client_fd, const char *command, char **response);
+bool client_send_device_command_timeout(int client_fd,
+                                        const char *command,
+                                        utimer_t timeout,
+                                        bool propagate,
+                                        char **response);
+bool client_send_device_commands(int client_fd,
+                                 const char **commands,
+                                 size_t count,
+                                 char **responses,
+                                 bool *results);
+bool client_send_streaming_command(int client_fd, const char *command, client_line_cb callback, void *arg);
+void client_response_init(struct client_response_t *parsed);
+bool client_parse_response(char *response, struct client_response_t *parsed);
+bool client_send_parsed_command(int client_fd, const char *command, struct client_response_t *parsed);
+void client_response_free(struct client_response_t *parsed);
+bool client_server_supports(int client_fd, const char *verb);
 bool client_request_device_state(int client_fd, const char *command, bool format);
+bool client_subscribe(int client_fd, const char *topic);
+bool client_receive_push(int client_fd, char *topic, size_t topic_size, char **response);
+bool client_enable_binary(int client_fd);
+bool client_send_binary_command(int client_fd, const char *command, char **response);
+bool client_receive_binary_push(int client_fd, char *topic, size_t topic_size, char **response);
 
 #endif
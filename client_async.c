@@ -0,0 +1,603 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "global.h"
+#include "client_async.h"
+#include "protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
+#include "uthash/uthash.h"
+#include "uthash/utlist.h"
+
+/// Delay before the first reconnection attempt (msec)
+#define CLIENT_ASYNC_RECONNECT_MIN 100
+/// Maximum delay between reconnection attempts (msec)
+#define CLIENT_ASYNC_RECONNECT_MAX 5000
+/// Command that switches the connection to binary framing
+#define CLIENT_ASYNC_NEGOTIATE "PROTOCOL binary\n"
+/// Response to a successful switch to binary framing
+#define CLIENT_ASYNC_NEGOTIATED "#START\r\n#STOP\r\n"
+
+enum client_async_state_t {
+  /// Waiting to reconnect
+  CLIENT_ASYNC_STATE_DISCONNECTED,
+  /// Connecting to the server
+  CLIENT_ASYNC_STATE_CONNECTING,
+  /// Waiting for the server to switch to binary framing
+  CLIENT_ASYNC_STATE_NEGOTIATING,
+  /// Connection is ready for commands
+  CLIENT_ASYNC_STATE_READY,
+};
+
+struct client_async_request_t {
+  /// Client context
+  struct client_async_t *client;
+  /// Request identifier (0 while waiting to be sent)
+  uint32_t id;
+  /// Command string
+  char *command;
+  /// Command length
+  size_t cmd_length;
+  /// Completion callback (can be NULL)
+  client_async_response_cb callback;
+  /// Completion callback argument
+  void *arg;
+  /// Deadline timer (can be NULL)
+  struct event *deadline;
+  /// Previous request waiting to be sent
+  struct client_async_request_t *prev;
+  /// Next request waiting to be sent
+  struct client_async_request_t *next;
+
+  UT_hash_handle hh;
+};
+
+struct client_async_topic_t {
+  /// Topic name
+  char *name;
+  /// Next topic
+  struct client_async_topic_t *next;
+};
+
+struct client_async_t {
+  /// Event base
+  struct event_base *base;
+  /// Server socket address
+  struct sockaddr_un address;
+  /// Connection state
+  enum client_async_state_t state;
+  /// Connection buffer (NULL while disconnected)
+  struct bufferevent *bev;
+  /// Reconnection timer
+  struct event *reconnect_timer;
+  /// Delay before the next reconnection attempt (msec)
+  unsigned int reconnect_delay;
+  /// Identifier of the last sent request
+  uint32_t last_id;
+  /// Requests waiting for the connection to become ready
+  struct client_async_request_t *queued;
+  /// Requests sent to the server, by identifier
+  struct client_async_request_t *outstanding;
+  /// Subscribed topics, renewed on every connection
+  struct client_async_topic_t *topics;
+  /// Callback for published responses (can be NULL)
+  client_async_push_cb push_callback;
+  /// Published response callback argument
+  void *push_arg;
+};
+
+// Forward declarations
+void client_async_connect(struct client_async_t *client);
+
+/**
+ * Completes a request, removing it from the client and invoking its
+ * callback.
+ *
+ * @param request Request to complete
+ * @param status Completion status
+ * @param response Response lines (can be NULL)
+ * @param length Response length
+ */
+void client_async_request_complete(struct client_async_request_t *request,
+                                   enum client_async_status_t status,
+                                   const char *response,
+                                   size_t length)
+{
+  struct client_async_t *client = request->client;
+  if (request->id != 0)
+    HASH_DEL(client->outstanding, request);
+  else
+    DL_DELETE(client->queued, request);
+
+  if (request->callback)
+    request->callback(client, status, response, length, request->arg);
+
+  if (request->deadline)
+    event_free(request->deadline);
+  free(request->command);
+  free(request);
+}
+
+/**
+ * Timer callback invoked when the deadline of a request expires. A
+ * response that arrives later is ignored.
+ *
+ * @param fd Unused
+ * @param events Event mask
+ * @param arg Request
+ */
+void client_async_deadline_cb(evutil_socket_t fd, short events, void *arg)
+{
+  struct client_async_request_t *request = (struct client_async_request_t*) arg;
+  DEBUG_LOG("DEBUG: Command timed out: %s\n", request->command);
+  client_async_request_complete(request, CLIENT_ASYNC_TIMEOUT, NULL, 0);
+}
+
+/**
+ * Sends a request to the server and registers it as outstanding.
+ *
+ * @param client Client context
+ * @param request Request to send
+ */
+void client_async_request_write(struct client_async_t *client, struct client_async_request_t *request)
+{
+  // Identifier 0 would ask the server to keep responses in order
+  if (++client->last_id == 0)
+    client->last_id++;
+
+  struct protocol_header_t header;
+  header.id = client->last_id;
+  header.status = 0;
+  header.flags = 0;
+  header.topic_length = 0;
+  header.length = request->cmd_length;
+
+  uint8_t buffer[PROTOCOL_HEADER_SIZE];
+  protocol_header_encode(&header, buffer);
+  bufferevent_write(client->bev, buffer, sizeof(buffer));
+  bufferevent_write(client->bev, request->command, request->cmd_length);
+
+  request->id = header.id;
+  HASH_ADD(hh, client->outstanding, id, sizeof(request->id), request);
+}
+
+/**
+ * Closes the connection and schedules a reconnection attempt. Commands
+ * that were sent over the connection fail, while commands waiting to be
+ * sent remain queued.
+ *
+ * @param client Client context
+ */
+void client_async_disconnect(struct client_async_t *client)
+{
+  if (client->bev) {
+    bufferevent_free(client->bev);
+    client->bev = NULL;
+  }
+
+  client->state = CLIENT_ASYNC_STATE_DISCONNECTED;
+
+  struct timeval tv = { client->reconnect_delay / 1000, (client->reconnect_delay % 1000) * 1000 };
+  evtimer_add(client->reconnect_timer, &tv);
+  DEBUG_LOG("DEBUG: Disconnected from server, reconnecting in %u ms.\n", client->reconnect_delay);
+
+  client->reconnect_delay *= 2;
+  if (client->reconnect_delay > CLIENT_ASYNC_RECONNECT_MAX)
+    client->reconnect_delay = CLIENT_ASYNC_RECONNECT_MAX;
+
+  struct client_async_request_t *request, *tmp;
+  HASH_ITER(hh, client->outstanding, request, tmp) {
+    client_async_request_complete(request, CLIENT_ASYNC_DISCONNECTED, NULL, 0);
+  }
+}
+
+/**
+ * Sends subscriptions and queued commands once the connection is ready.
+ *
+ * @param client Client context
+ */
+void client_async_ready(struct client_async_t *client)
+{
+  client->state = CLIENT_ASYNC_STATE_READY;
+  client->reconnect_delay = CLIENT_ASYNC_RECONNECT_MIN;
+  DEBUG_LOG("DEBUG: Connected to server.\n");
+
+  struct client_async_topic_t *topic;
+  LL_FOREACH(client->topics, topic) {
+    char command[128];
+    snprintf(command, sizeof(command), "SUBSCRIBE %s\n", topic->name);
+    client_async_send(client, command, NULL, NULL, NULL);
+  }
+
+  struct client_async_request_t *request, *tmp;
+  DL_FOREACH_SAFE(client->queued, request, tmp) {
+    DL_DELETE(client->queued, request);
+    client_async_request_write(client, request);
+  }
+}
+
+/**
+ * Removes carriage returns that precede newlines, so that responses
+ * look the same as those returned by the blocking client.
+ *
+ * @param data Response data
+ * @param length Response length
+ * @return Normalized response length
+ */
+size_t client_async_normalize(char *data, size_t length)
+{
+  char *cr = memchr(data, '\r', length);
+  if (!cr)
+    return length;
+
+  size_t i, out = cr - data;
+  for (i = out; i < length; i++) {
+    if (data[i] == '\r' && i + 1 < length && data[i + 1] == '\n')
+      continue;
+    data[out++] = data[i];
+  }
+
+  return out;
+}
+
+/**
+ * Processes the next frame received from the server.
+ *
+ * @param client Client context
+ * @param input Buffer with received data
+ * @return True when a frame has been processed, false when more data
+ *   is needed or the connection has been closed due to an invalid frame
+ */
+bool client_async_read_frame(struct client_async_t *client, struct evbuffer *input)
+{
+  uint8_t buffer[PROTOCOL_HEADER_SIZE];
+  if (evbuffer_copyout(input, buffer, sizeof(buffer)) < (ssize_t) sizeof(buffer))
+    return false;
+
+  // Topics fit into a request, as clients subscribe to them by name
+  struct protocol_header_t header;
+  protocol_header_decode(&header, buffer);
+  if (header.topic_length > header.length || header.topic_length >= PROTOCOL_MAX_REQUEST ||
+      header.length > PROTOCOL_MAX_RESPONSE) {
+    fprintf(stderr, "ERROR: Invalid frame received from server!\n");
+    client_async_disconnect(client);
+    return false;
+  }
+
+  if (evbuffer_get_length(input) < sizeof(buffer) + header.length)
+    return false;
+
+  // Empty frames (such as acknowledgements) have nothing to pull up, but
+  // callbacks still get a non-NULL response
+  char empty[1] = "";
+  char *payload = empty;
+  evbuffer_drain(input, sizeof(buffer));
+  if (header.length > 0) {
+    payload = (char*) evbuffer_pullup(input, header.length);
+    if (!payload) {
+      fprintf(stderr, "ERROR: Failed to read frame received from server!\n");
+      client_async_disconnect(client);
+      return false;
+    }
+  }
+
+  char *body = payload + header.topic_length;
+  size_t length = client_async_normalize(body, header.length - header.topic_length);
+
+  if (header.flags & PROTOCOL_FLAG_PUSH) {
+    char topic[PROTOCOL_MAX_REQUEST];
+    memcpy(topic, payload, header.topic_length);
+    topic[header.topic_length] = 0;
+
+    if (client->push_callback)
+      client->push_callback(client, topic, body, length, client->push_arg);
+  } else {
+    struct client_async_request_t *request;
+    HASH_FIND(hh, client->outstanding, &header.id, sizeof(header.id), request);
+    if (request) {
+      if (header.status == PROTOCOL_STATUS_OK)
+        client_async_request_complete(request, CLIENT_ASYNC_OK, body, length);
+      else
+        client_async_request_complete(request, CLIENT_ASYNC_ERROR, NULL, 0);
+    } else {
+      DEBUG_LOG("DEBUG: Dropping response to expired request %u.\n", header.id);
+    }
+  }
+
+  evbuffer_drain(input, header.length);
+  return true;
+}
+
+/**
+ * Callback for connection read events.
+ *
+ * @param bev Buffer event
+ * @param ctx Client context
+ */
+void client_async_read_cb(struct bufferevent *bev, void *ctx)
+{
+  struct client_async_t *client = (struct client_async_t*) ctx;
+  struct evbuffer *input = bufferevent_get_input(bev);
+
+  if (client->state == CLIENT_ASYNC_STATE_NEGOTIATING) {
+    size_t length = strlen(CLIENT_ASYNC_NEGOTIATED);
+    if (evbuffer_get_length(input) < length)
+      return;
+
+    if (memcmp(evbuffer_pullup(input, length), CLIENT_ASYNC_NEGOTIATED, length) != 0) {
+      fprintf(stderr, "ERROR: Server does not support binary framing!\n");
+      client_async_disconnect(client);
+      return;
+    }
+
+    evbuffer_drain(input, length);
+    client_async_ready(client);
+  }
+
+  // Callbacks may not reconnect, so the connection stays the same
+  while (client_async_read_frame(client, input))
+    ;
+}
+
+/**
+ * Callback for connection exceptional events.
+ *
+ * @param bev Buffer event
+ * @param events Event mask
+ * @param ctx Client context
+ */
+void client_async_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+  struct client_async_t *client = (struct client_async_t*) ctx;
+
+  if (events & BEV_EVENT_CONNECTED) {
+    client->state = CLIENT_ASYNC_STATE_NEGOTIATING;
+    bufferevent_write(bev, CLIENT_ASYNC_NEGOTIATE, strlen(CLIENT_ASYNC_NEGOTIATE));
+  } else if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+    client_async_disconnect(client);
+  }
+}
+
+/**
+ * Starts connecting to the server.
+ *
+ * @param client Client context
+ */
+void client_async_connect(struct client_async_t *client)
+{
+  client->state = CLIENT_ASYNC_STATE_CONNECTING;
+  client->bev = bufferevent_socket_new(client->base, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (!client->bev) {
+    client_async_disconnect(client);
+    return;
+  }
+
+  bufferevent_setcb(client->bev, client_async_read_cb, NULL, client_async_event_cb, client);
+  bufferevent_enable(client->bev, EV_READ | EV_WRITE);
+  if (bufferevent_socket_connect(client->bev, (struct sockaddr*) &client->address, sizeof(client->address)) < 0)
+    client_async_disconnect(client);
+}
+
+/**
+ * Timer callback for reconnection attempts.
+ *
+ * @param fd Unused
+ * @param events Event mask
+ * @param arg Client context
+ */
+void client_async_reconnect_cb(evutil_socket_t fd, short events, void *arg)
+{
+  client_async_connect((struct client_async_t*) arg);
+}
+
+/**
+ * Creates a new asynchronous client and starts connecting to the
+ * server. The connection is reestablished automatically whenever it is
+ * lost.
+ *
+ * @param base Event base the client runs on
+ * @param socket_path Path to the server's UNIX socket
+ * @return Newly created client context or NULL if something went wrong
+ */
+struct client_async_t *client_async_new(struct event_base *base, const char *socket_path)
+{
+  struct client_async_t *client = (struct client_async_t*) malloc(sizeof(struct client_async_t));
+  if (!client)
+    return NULL;
+
+  memset(&client->address, 0, sizeof(client->address));
+  client->address.sun_family = AF_UNIX;
+  strncpy(client->address.sun_path, socket_path, sizeof(client->address.sun_path) - 1);
+
+  client->base = base;
+  client->state = CLIENT_ASYNC_STATE_DISCONNECTED;
+  client->bev = NULL;
+  client->reconnect_delay = CLIENT_ASYNC_RECONNECT_MIN;
+  client->last_id = 0;
+  client->queued = NULL;
+  client->outstanding = NULL;
+  client->topics = NULL;
+  client->push_callback = NULL;
+  client->push_arg = NULL;
+  client->reconnect_timer = evtimer_new(base, client_async_reconnect_cb, client);
+  if (!client->reconnect_timer) {
+    free(client);
+    return NULL;
+  }
+
+  client_async_connect(client);
+  return client;
+}
+
+/**
+ * Frees the client, closing its connection. Outstanding and queued
+ * commands complete with CLIENT_ASYNC_DISCONNECTED. The client must not
+ * be freed from its own callbacks.
+ *
+ * @param client Client context
+ */
+void client_async_free(struct client_async_t *client)
+{
+  if (!client)
+    return;
+
+  if (client->bev)
+    bufferevent_free(client->bev);
+
+  struct client_async_request_t *request, *tmp;
+  HASH_ITER(hh, client->outstanding, request, tmp) {
+    client_async_request_complete(request, CLIENT_ASYNC_DISCONNECTED, NULL, 0);
+  }
+  DL_FOREACH_SAFE(client->queued, request, tmp) {
+    client_async_request_complete(request, CLIENT_ASYNC_DISCONNECTED, NULL, 0);
+  }
+
+  struct client_async_topic_t *topic, *ttmp;
+  LL_FOREACH_SAFE(client->topics, topic, ttmp) {
+    free(topic->name);
+    free(topic);
+  }
+
+  event_free(client->reconnect_timer);
+  free(client);
+}
+
+/**
+ * Sets the callback invoked for responses published to subscribed
+ * topics.
+ *
+ * @param client Client context
+ * @param callback Callback (can be NULL)
+ * @param arg Callback argument
+ */
+void client_async_set_push_cb(struct client_async_t *client, client_async_push_cb callback, void *arg)
+{
+  client->push_callback = callback;
+  client->push_arg = arg;
+}
+
+/**
+ * Returns true while the connection to the server is established.
+ *
+ * @param client Client context
+ * @return True if commands are sent immediately
+ */
+bool client_async_is_connected(struct client_async_t *client)
+{
+  return client->state == CLIENT_ASYNC_STATE_READY;
+}
+
+/**
+ * Sends a command to the server without waiting for the response. Any
+ * number of commands may be outstanding and their callbacks are invoked
+ * in the order that responses arrive. Commands posted while the client
+ * is disconnected are sent once the connection is reestablished.
+ *
+ * @param client Client context
+ * @param command Command string to send
+ * @param timeout Time to wait for the response (can be NULL)
+ * @param callback Completion callback (can be NULL)
+ * @param arg Completion callback argument
+ * @return True on success, false if something went wrong
+ */
+bool client_async_send(struct client_async_t *client,
+                       const char *command,
+                       const struct timeval *timeout,
+                       client_async_response_cb callback,
+                       void *arg)
+{
+  size_t length = strlen(command);
+  if (length == 0 || length > PROTOCOL_MAX_REQUEST)
+    return false;
+
+  struct client_async_request_t *request = (struct client_async_request_t*) malloc(sizeof(struct client_async_request_t));
+  if (!request)
+    return false;
+
+  request->client = client;
+  request->id = 0;
+  request->command = strdup(command);
+  request->cmd_length = length;
+  request->callback = callback;
+  request->arg = arg;
+  request->deadline = NULL;
+  request->prev = NULL;
+  request->next = NULL;
+  if (!request->command) {
+    free(request);
+    return false;
+  }
+
+  if (timeout) {
+    request->deadline = evtimer_new(client->base, client_async_deadline_cb, request);
+    if (!request->deadline) {
+      free(request->command);
+      free(request);
+      return false;
+    }
+    evtimer_add(request->deadline, timeout);
+  }
+
+  if (client->state == CLIENT_ASYNC_STATE_READY)
+    client_async_request_write(client, request);
+  else
+    DL_APPEND(client->queued, request);
+
+  return true;
+}
+
+/**
+ * Subscribes to periodic publications of a topic. Published responses
+ * are delivered to the callback set with client_async_set_push_cb() and
+ * the subscription is renewed whenever the connection is reestablished.
+ *
+ * @param client Client context
+ * @param topic Topic name
+ * @return True on success, false if something went wrong
+ */
+bool client_async_subscribe(struct client_async_t *client, const char *topic)
+{
+  struct client_async_topic_t *entry = (struct client_async_topic_t*) malloc(sizeof(struct client_async_topic_t));
+  if (!entry)
+    return false;
+
+  entry->name = strdup(topic);
+  if (!entry->name) {
+    free(entry);
+    return false;
+  }
+
+  LL_APPEND(client->topics, entry);
+
+  if (client->state == CLIENT_ASYNC_STATE_READY) {
+    char command[128];
+    snprintf(command, sizeof(command), "SUBSCRIBE %s\n", topic);
+    return client_async_send(client, command, NULL, NULL, NULL);
+  }
+
+  return true;
+}
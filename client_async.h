@@ -0,0 +1,85 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_CONTROLLER_CLIENT_ASYNC_H
+#define KORUZA_CONTROLLER_CLIENT_ASYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#include <event2/event.h>
+
+enum client_async_status_t {
+  /// Command completed successfully
+  CLIENT_ASYNC_OK = 0,
+  /// Server or device returned an error
+  CLIENT_ASYNC_ERROR,
+  /// Deadline expired before the response was received
+  CLIENT_ASYNC_TIMEOUT,
+  /// Connection was lost while the command was outstanding
+  CLIENT_ASYNC_DISCONNECTED,
+};
+
+struct client_async_t;
+
+/**
+ * Callback invoked when a command completes. The response is not
+ * NUL-terminated and is only valid during the callback.
+ *
+ * @param client Client context
+ * @param status Completion status
+ * @param response Response lines (NULL unless successful)
+ * @param length Response length
+ * @param arg User argument
+ */
+typedef void (*client_async_response_cb)(struct client_async_t *client,
+                                         enum client_async_status_t status,
+                                         const char *response,
+                                         size_t length,
+                                         void *arg);
+
+/**
+ * Callback invoked for each response published to a subscribed topic.
+ * The response is not NUL-terminated and is only valid during the
+ * callback.
+ *
+ * @param client Client context
+ * @param topic Topic name
+ * @param response Response lines
+ * @param length Response length
+ * @param arg User argument
+ */
+typedef void (*client_async_push_cb)(struct client_async_t *client,
+                                     const char *topic,
+                                     const char *response,
+                                     size_t length,
+                                     void *arg);
+
+struct client_async_t *client_async_new(struct event_base *base, const char *socket_path);
+void client_async_free(struct client_async_t *client);
+void client_async_set_push_cb(struct client_async_t *client, client_async_push_cb callback, void *arg);
+bool client_async_is_connected(struct client_async_t *client);
+bool client_async_send(struct client_async_t *client,
+                       const char *command,
+                       const struct timeval *timeout,
+                       client_async_response_cb callback,
+                       void *arg);
+bool client_async_subscribe(struct client_async_t *client, const char *topic);
+
+#endif
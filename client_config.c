@@ -0,0 +1,45 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "client.h"
+#include "client_config.h"
+
+#include <stdio.h>
+
+/**
+ * Establishes a connection with the control server configured in the
+ * server section of the configuration file. This is kept out of the
+ * client library, so that the library does not depend on libucl.
+ *
+ * @param cfg_server Server configuration object
+ * @return Socket file descriptor
+ */
+int client_connect(const ucl_object_t *cfg_server)
+{
+  const ucl_object_t *obj = ucl_object_find_key(cfg_server, "socket");
+  const char *socket_path;
+  if (!obj) {
+    fprintf(stderr, "ERROR: Missing 'socket' in configuration file!\n");
+    return -1;
+  } else if (!ucl_object_tostring_safe(obj, &socket_path)) {
+    fprintf(stderr, "ERROR: Socket path must be a string!\n");
+    return -1;
+  }
+
+  return client_connect_path(socket_path);
+}
@@ -0,0 +1,26 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_CONTROLLER_CLIENT_CONFIG_H
+#define KORUZA_CONTROLLER_CLIENT_CONFIG_H
+
+#include <ucl.h>
+
+int client_connect(const ucl_object_t *cfg_server);
+
+#endif
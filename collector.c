@@ -18,6 +18,7 @@
  */
 #include "global.h"
 #include "client.h"
+#include "client_config.h"
 #include "util.h"
 
 #include "uthash/uthash.h"
@@ -35,6 +36,48 @@ struct collector_cfg_t {
   const char *of_name;
   /// Value format string
   const char *of_value;
+  /// Operators overriding those sent by the device, by key (can be NULL)
+  const ucl_object_t *operators;
+};
+
+struct collector_aggregator_t;
+
+struct collector_sample_t {
+  /// Time when the value was collected
+  double time;
+  /// Collected value
+  double value;
+};
+
+struct collector_ring_t {
+  /// Stored samples, oldest first starting at head
+  struct collector_sample_t *samples;
+  /// Number of allocated samples (a power of two)
+  size_t capacity;
+  /// Index of the oldest sample
+  size_t head;
+  /// Number of stored samples
+  size_t count;
+};
+
+/// Window state needed by an aggregator
+#define COLLECTOR_WINDOW_SUM 0x01
+#define COLLECTOR_WINDOW_MIN 0x02
+#define COLLECTOR_WINDOW_MAX 0x04
+
+struct collector_window_t {
+  /// Window length (sec)
+  double length;
+  /// Maintained window state (COLLECTOR_WINDOW_* flags)
+  unsigned int track;
+  /// Samples within the window
+  struct collector_ring_t samples;
+  /// Sum of samples within the window
+  double sum;
+  /// Samples that may still become the minimum, in increasing order
+  struct collector_ring_t min;
+  /// Samples that may still become the maximum, in decreasing order
+  struct collector_ring_t max;
 };
 
 struct log_item_t {
@@ -52,10 +95,327 @@ struct log_item_t {
   double max;
   /// Minimum of stored values
   double min;
+  /// Aggregator that derives the reported value
+  struct collector_aggregator_t *aggregator;
+  /// Sliding window the aggregator is applied to (NULL for all values)
+  struct collector_window_t *window;
 
   UT_hash_handle hh;
 };
 
+struct collector_aggregator_t {
+  /// Operator name
+  const char *name;
+  /// Derives the reported value from stored values
+  double (*aggregate)(struct log_item_t *item);
+  /// Derives the reported value from values within the item's window
+  double (*aggregate_window)(struct collector_window_t *window);
+  /// Window state needed by aggregate_window (COLLECTOR_WINDOW_* flags)
+  unsigned int track;
+};
+
+double collector_aggregate_avg(struct log_item_t *item)
+{
+  return item->sum / item->count;
+}
+
+double collector_aggregate_min(struct log_item_t *item)
+{
+  return item->min;
+}
+
+double collector_aggregate_max(struct log_item_t *item)
+{
+  return item->max;
+}
+
+double collector_aggregate_sum(struct log_item_t *item)
+{
+  return item->sum;
+}
+
+double collector_window_avg(struct collector_window_t *window)
+{
+  return window->sum / window->samples.count;
+}
+
+double collector_window_min(struct collector_window_t *window)
+{
+  return window->min.samples[window->min.head].value;
+}
+
+double collector_window_max(struct collector_window_t *window)
+{
+  return window->max.samples[window->max.head].value;
+}
+
+double collector_window_sum(struct collector_window_t *window)
+{
+  return window->sum;
+}
+
+/// Aggregation operators, the first one is used by default
+struct collector_aggregator_t collector_aggregators[] = {
+  { "avg", collector_aggregate_avg, collector_window_avg, COLLECTOR_WINDOW_SUM },
+  { "min", collector_aggregate_min, collector_window_min, COLLECTOR_WINDOW_MIN },
+  { "max", collector_aggregate_max, collector_window_max, COLLECTOR_WINDOW_MAX },
+  { "sum", collector_aggregate_sum, collector_window_sum, COLLECTOR_WINDOW_SUM },
+  { NULL, NULL, NULL, 0 },
+};
+
+/**
+ * Looks up an aggregation operator by name.
+ *
+ * @param name Operator name
+ * @return Aggregator or NULL if there is no such operator
+ */
+struct collector_aggregator_t *collector_find_aggregator(const char *name)
+{
+  struct collector_aggregator_t *aggregator;
+  for (aggregator = collector_aggregators; aggregator->name != NULL; aggregator++) {
+    if (strcmp(aggregator->name, name) == 0)
+      return aggregator;
+  }
+
+  return NULL;
+}
+
+/**
+ * Parses the operator configured for a key. It is either an operator
+ * name or an object with an optional operator name and the length of
+ * the sliding window that the operator is applied to.
+ *
+ * @param obj Operator configuration
+ * @param op Output operator name (NULL when not configured)
+ * @param window Output window length in seconds (0 for all values)
+ * @return True on success, false when the configuration is invalid
+ */
+bool collector_parse_operator(const ucl_object_t *obj, const char **op, double *window)
+{
+  *window = 0;
+  if (ucl_object_tostring_safe(obj, op))
+    return true;
+
+  *op = NULL;
+  const ucl_object_t *cfg_window = ucl_object_find_key(obj, "window");
+  if (!cfg_window || !ucl_object_todouble_safe(cfg_window, window) || *window <= 0)
+    return false;
+
+  const ucl_object_t *cfg_op = ucl_object_find_key(obj, "operator");
+  if (cfg_op && !ucl_object_tostring_safe(cfg_op, op))
+    return false;
+
+  return true;
+}
+
+/**
+ * Resolves the aggregator of a new item. Operators configured for the
+ * key take precedence over the one sent by the device, and unknown
+ * operators fall back to the default.
+ *
+ * @param cfg Collector configuration
+ * @param key Response key
+ * @param op Operator sent by the device (can be NULL)
+ * @param window Output window length in seconds (0 for all values)
+ * @return Aggregator
+ */
+struct collector_aggregator_t *collector_resolve_aggregator(struct collector_cfg_t *cfg,
+                                                            const char *key,
+                                                            const char *op,
+                                                            double *window)
+{
+  const char *name;
+  const ucl_object_t *obj = cfg->operators ? ucl_object_find_key(cfg->operators, key) : NULL;
+  *window = 0;
+  if (obj && collector_parse_operator(obj, &name, window) && name)
+    op = name;
+
+  struct collector_aggregator_t *aggregator = op ? collector_find_aggregator(op) : NULL;
+  return aggregator ? aggregator : &collector_aggregators[0];
+}
+
+/// Largest short key that is indexed directly
+#define COLLECTOR_MAX_SHORT_KEY 4095
+
+struct collector_key_t {
+  /// Formatted metadata name (NULL until first seen)
+  char *name;
+  /// Value item (NULL until first seen)
+  struct log_item_t *item;
+};
+
+struct collector_table_t {
+  /// Value items by formatted key, in order of appearance
+  struct log_item_t *items;
+  /// Short keys indexed directly by their numeric value
+  struct collector_key_t *keys;
+  /// Number of allocated short keys
+  size_t size;
+};
+
+/**
+ * Appends a sample to a ring, growing it when full.
+ *
+ * @param ring Sample ring
+ * @param time Sample time
+ * @param value Sample value
+ * @return True on success, false when out of memory
+ */
+bool collector_ring_push(struct collector_ring_t *ring, double time, double value)
+{
+  if (ring->count == ring->capacity) {
+    size_t capacity = ring->capacity ? ring->capacity * 2 : 16;
+    struct collector_sample_t *samples = malloc(capacity * sizeof(struct collector_sample_t));
+    if (!samples)
+      return false;
+
+    // Unwrap stored samples so that the oldest one is first
+    size_t i;
+    for (i = 0; i < ring->count; i++)
+      samples[i] = ring->samples[(ring->head + i) & (ring->capacity - 1)];
+
+    free(ring->samples);
+    ring->samples = samples;
+    ring->capacity = capacity;
+    ring->head = 0;
+  }
+
+  struct collector_sample_t *sample = &ring->samples[(ring->head + ring->count) & (ring->capacity - 1)];
+  sample->time = time;
+  sample->value = value;
+  ring->count++;
+  return true;
+}
+
+/**
+ * Returns the newest sample of a non-empty ring.
+ *
+ * @param ring Sample ring
+ * @return Newest sample
+ */
+struct collector_sample_t *collector_ring_back(struct collector_ring_t *ring)
+{
+  return &ring->samples[(ring->head + ring->count - 1) & (ring->capacity - 1)];
+}
+
+/**
+ * Removes samples collected at or before the given time from the front
+ * of a ring.
+ *
+ * @param ring Sample ring
+ * @param start Window start time
+ * @param sum Sum to subtract removed values from (can be NULL)
+ */
+void collector_ring_expire(struct collector_ring_t *ring, double start, double *sum)
+{
+  while (ring->count > 0 && ring->samples[ring->head].time <= start) {
+    if (sum)
+      *sum -= ring->samples[ring->head].value;
+    ring->head = (ring->head + 1) & (ring->capacity - 1);
+    ring->count--;
+  }
+}
+
+/**
+ * Adds a sample to a monotonic ring holding the minimum or maximum of a
+ * window at its front. Samples that can no longer become the extreme are
+ * dropped from the back, so each sample is pushed and removed once.
+ *
+ * @param ring Sample ring
+ * @param start Window start time
+ * @param time Sample time
+ * @param value Sample value
+ * @param max True to track the maximum, false for the minimum
+ */
+void collector_ring_extreme(struct collector_ring_t *ring, double start, double time, double value, bool max)
+{
+  collector_ring_expire(ring, start, NULL);
+  while (ring->count > 0) {
+    double back = collector_ring_back(ring)->value;
+    if (max ? back > value : back < value)
+      break;
+
+    ring->count--;
+  }
+
+  collector_ring_push(ring, time, value);
+}
+
+/**
+ * Creates a sliding window.
+ *
+ * @param length Window length in seconds
+ * @param track Window state to maintain (COLLECTOR_WINDOW_* flags)
+ * @return Window or NULL when out of memory
+ */
+struct collector_window_t *collector_window_new(double length, unsigned int track)
+{
+  struct collector_window_t *window = calloc(1, sizeof(struct collector_window_t));
+  if (!window)
+    return NULL;
+
+  window->length = length;
+  window->track = track;
+  return window;
+}
+
+/**
+ * Frees a sliding window.
+ *
+ * @param window Window (can be NULL)
+ */
+void collector_window_free(struct collector_window_t *window)
+{
+  if (!window)
+    return;
+
+  free(window->samples.samples);
+  free(window->min.samples);
+  free(window->max.samples);
+  free(window);
+}
+
+/**
+ * Adds a sample to a sliding window and expires samples that fell out
+ * of it. Runs in amortised constant time.
+ *
+ * @param window Window
+ * @param time Sample time (monotonic, sec)
+ * @param value Sample value
+ * @return True when the window holds the sample, false when out of memory
+ */
+bool collector_window_add(struct collector_window_t *window, double time, double value)
+{
+  double start = time - window->length;
+  bool ok = true;
+
+  if (window->track & COLLECTOR_WINDOW_SUM) {
+    struct collector_ring_t *ring = &window->samples;
+    collector_ring_expire(ring, start, &window->sum);
+
+    // Start over once the window is empty to discard rounding errors
+    if (ring->count == 0)
+      window->sum = 0.0;
+
+    if (collector_ring_push(ring, time, value))
+      window->sum += value;
+    else
+      ok = ring->count > 0;
+  }
+
+  if (window->track & COLLECTOR_WINDOW_MIN) {
+    collector_ring_extreme(&window->min, start, time, value, false);
+    ok = ok && window->min.count > 0;
+  }
+
+  if (window->track & COLLECTOR_WINDOW_MAX) {
+    collector_ring_extreme(&window->max, start, time, value, true);
+    ok = ok && window->max.count > 0;
+  }
+
+  return ok;
+}
+
 double collector_get_time()
 {
   struct timeval tv;
@@ -66,21 +426,162 @@ double collector_get_time()
   return (double) time(NULL);
 }
 
+/**
+ * Returns the numeric value of a key that can be indexed directly. Only
+ * canonical decimal keys qualify, as formatted names use the key as
+ * written.
+ *
+ * @param key Response key
+ * @return Short key or -1 if the key is not indexed directly
+ */
+int collector_short_key(const char *key)
+{
+  if (*key == 0 || (key[0] == '0' && key[1] != 0))
+    return -1;
+
+  int value = 0;
+  for (; *key != 0; key++) {
+    if (*key < '0' || *key > '9')
+      return -1;
+
+    value = value * 10 + (*key - '0');
+    if (value > COLLECTOR_MAX_SHORT_KEY)
+      return -1;
+  }
+
+  return value;
+}
+
+/**
+ * Returns the directly indexed slot for a short key, growing the index
+ * as needed.
+ *
+ * @param table Log table
+ * @param key_short Short key
+ * @return Slot or NULL if the key is not indexed directly
+ */
+struct collector_key_t *collector_table_slot(struct collector_table_t *table, int key_short)
+{
+  if (key_short < 0)
+    return NULL;
+
+  if ((size_t) key_short >= table->size) {
+    size_t size = table->size ? table->size : 64;
+    while (size <= (size_t) key_short)
+      size *= 2;
+
+    struct collector_key_t *keys = realloc(table->keys, size * sizeof(struct collector_key_t));
+    if (!keys)
+      return NULL;
+
+    memset(keys + table->size, 0, (size - table->size) * sizeof(struct collector_key_t));
+    table->keys = keys;
+    table->size = size;
+  }
+
+  return &table->keys[key_short];
+}
+
+/**
+ * Formats the output name of a key. Numeric keys are expanded using
+ * the given format, other keys are used unchanged.
+ *
+ * @param format Name format string
+ * @param key Response key
+ * @param buffer Buffer for the formatted name
+ * @param size Size of buffer
+ * @param key_short Output numeric key (-1 if the key is not numeric)
+ * @return Formatted name
+ */
+const char *collector_format_key(const char *format, const char *key, char *buffer, size_t size, int *key_short)
+{
+  char *endptr = NULL;
+  *key_short = strtol(key, &endptr, 10);
+  if (*endptr != 0) {
+    *key_short = -1;
+    return key;
+  }
+
+  snprintf(buffer, size, format, key);
+  return buffer;
+}
+
+/**
+ * Looks up the log item of a value key by its formatted name, creating
+ * it if it does not exist yet. The aggregation operator and its window
+ * are resolved once, when the item is created.
+ *
+ * @param cfg Collector configuration
+ * @param table Log table
+ * @param key Response key
+ * @param op Operator sent by the device (can be NULL)
+ * @param value First value of a new item
+ * @return Log item
+ */
+struct log_item_t *collector_find_item(struct collector_cfg_t *cfg,
+                                       struct collector_table_t *table,
+                                       const char *key,
+                                       const char *op,
+                                       double value)
+{
+  char fmt_key[256];
+  int key_short;
+  const char *name = collector_format_key(cfg->of_value, key, fmt_key, sizeof(fmt_key), &key_short);
+  double window;
+
+  struct log_item_t *item;
+  HASH_FIND_STR(table->items, name, item);
+  if (!item) {
+    // Create new item and store it
+    item = (struct log_item_t*) malloc(sizeof(struct log_item_t));
+    item->key = strdup(name);
+    item->key_short = key_short;
+    item->count = 0;
+    item->sum = 0.0;
+    item->min = value;
+    item->max = value;
+    item->aggregator = collector_resolve_aggregator(cfg, key, op, &window);
+    item->window = window > 0 ? collector_window_new(window, item->aggregator->track) : NULL;
+
+    HASH_ADD_KEYPTR(hh, table->items, item->key, strlen(item->key), item);
+  }
+
+  return item;
+}
+
+/**
+ * Removes all items from the log table.
+ *
+ * @param table Log table
+ */
+void collector_table_reset(struct collector_table_t *table)
+{
+  struct log_item_t *item, *tmp;
+  HASH_ITER(hh, table->items, item, tmp) {
+    HASH_DEL(table->items, item);
+    free(item->key);
+    collector_window_free(item->window);
+    free(item);
+  }
+
+  size_t i;
+  for (i = 0; i < table->size; i++)
+    free(table->keys[i].name);
+  memset(table->keys, 0, table->size * sizeof(struct collector_key_t));
+}
+
 void collector_parse_response(struct collector_cfg_t *cfg,
-                              struct log_item_t **log_table,
-                              const char *response,
+                              struct collector_table_t *table,
+                              struct client_response_t *response,
                               gzFile log,
                               FILE *state,
                               FILE *last_state,
                               FILE *last_state_json)
 {
   // Do not attempt to parse NULL responses
-  if (!response)
+  if (!response->buffer)
     return;
 
-  char *rsp = strdup(response);
-  char *rsp_tok = rsp;
-
   ftruncate(fileno(state), 0);
   rewind(state);
   if (last_state != NULL) {
@@ -94,66 +595,40 @@ void collector_parse_response(struct collector_cfg_t *cfg,
     fprintf(last_state_json, "{");
   }
 
-  // Each line in the form of <key>: <double> is a valid response
+  // Each line in the form of <key>: <double> is a valid response, lines
+  // have already been split and classified by the client; windows are
+  // timed by the monotonic clock so that clock adjustments do not move them
+  double now = timer_now() / 1000.0;
   bool json_previous = false;
-  for (;; rsp_tok = NULL) {
-    char *line = strtok(rsp_tok, "\n");
-    if (!line)
-      break;
-
-    char key[256] = {0,};
-    int key_short = -1;
-    char op[128] = {0,};
-    char value_str[256] = {0,};
-    double value;
-    bool metadata = false;
-
-    if (sscanf(line, "%[^:]%*c %[^:]%*c%lf", key, op, &value) == 3) {
-      // Value line with operator specification
-    } else if (sscanf(line, "%[^:]%*c%lf", key, &value) == 2) {
-      // Value line specification, default to "avg" operator
-      strcpy(op, "avg");
-    } else if (sscanf(line, "%[^:]: %250[^\n]", key, value_str) == 2) {
-      // Nodewatcher metadata line -- output unchanged line to state file
-      metadata = true;
-    } else {
-      continue;
-    }
-
-    // Support shortened output format for names and values
-    char *endptr = NULL;
-    key_short = strtol(key, &endptr, 10);
-    if (*endptr == 0) {
-      char fmt_key[256] = {0,};
-      if (metadata)
-        snprintf(fmt_key, sizeof(fmt_key), cfg->of_name, key);
-      else
-        snprintf(fmt_key, sizeof(fmt_key), cfg->of_value, key);
-
-      strncpy(key, fmt_key, sizeof(key));
-    } else {
-      key_short = -1;
-    }
-
+  size_t i;
+  for (i = 0; i < response->count; i++) {
+    struct client_field_t *field = &response->fields[i];
+    bool metadata = field->type == CLIENT_FIELD_METADATA;
+    double value = field->value;
+
+    // Support shortened output format for names and values, which are
+    // only formatted once for directly indexed keys
+    struct collector_key_t *slot = collector_table_slot(table, collector_short_key(field->key));
     if (metadata) {
-      fprintf(state, "%s: %s\n", key, value_str);
+      const char *name = slot ? slot->name : NULL;
+      char fmt_key[256];
+      if (!name) {
+        int key_short;
+        name = collector_format_key(cfg->of_name, field->key, fmt_key, sizeof(fmt_key), &key_short);
+        if (slot)
+          slot->name = strdup(name);
+      }
+
+      fprintf(state, "%s: %s\n", name, field->string);
       continue;
     }
 
     // Value line -- store into the log hash table
-    struct log_item_t *item;
-    HASH_FIND_STR(*log_table, key, item);
+    struct log_item_t *item = slot ? slot->item : NULL;
     if (!item) {
-      // Create new item and store it
-      item = (struct log_item_t*) malloc(sizeof(struct log_item_t));
-      item->key = strdup(key);
-      item->key_short = key_short;
-      item->count = 0;
-      item->sum = 0.0;
-      item->min = value;
-      item->max = value;
-
-      HASH_ADD_KEYPTR(hh, *log_table, item->key, strlen(item->key), item);
+      item = collector_find_item(cfg, table, field->key, field->op, value);
+      if (slot)
+        slot->item = item;
     }
 
     item->last = value;
@@ -164,18 +639,13 @@ void collector_parse_response(struct collector_cfg_t *cfg,
     if (value > item->max)
       item->max = value;
 
-    // Calculate value based on selected operator
+    // Calculate value based on the operator resolved for this item, over
+    // its window when one is configured
     double derived;
-    if (strcmp(op, "min") == 0)
-      derived = item->min;
-    else if (strcmp(op, "max") == 0)
-      derived = item->max;
-    else if (strcmp(op, "sum") == 0)
-      derived = item->sum;
-    else if (strcmp(op, "avg") == 0)
-      derived = item->sum / item->count;
+    if (item->window && collector_window_add(item->window, now, value))
+      derived = item->aggregator->aggregate_window(item->window);
     else
-      derived = item->sum / item->count;
+      derived = item->aggregator->aggregate(item);
 
     fprintf(state, "%s: %f\n", item->key, derived);
     if (last_state != NULL) {
@@ -187,13 +657,11 @@ void collector_parse_response(struct collector_cfg_t *cfg,
     }
   }
 
-  free(rsp);
-
   // Output current state and log last values
   struct log_item_t *item;
 
   gzprintf(log, "%f", collector_get_time());
-  for (item = *log_table; item != NULL; item = item->hh.next) {
+  for (item = table->items; item != NULL; item = item->hh.next) {
     if (item->key_short >= 0)
       gzprintf(log, "\t%d\t%f", item->key_short, item->last);
     else
@@ -250,6 +718,30 @@ bool start_collector(ucl_object_t *config, int log_option)
     return false;
   }
 
+  // Polled status requests may give up on a hung server
+  double timeout_sec = 0;
+  obj = ucl_object_find_key(cfg_client, "timeout");
+  if (obj && (!ucl_object_todouble_safe(obj, &timeout_sec) || timeout_sec <= 0)) {
+    fprintf(stderr, "ERROR: Client timeout must be a positive number!\n");
+    return false;
+  }
+  utimer_t timeout_msec = (utimer_t) (timeout_sec * 1000);
+
+  bool propagate_deadline = false;
+  obj = ucl_object_find_key(cfg_client, "propagate_deadline");
+  if (obj && !ucl_object_toboolean_safe(obj, &propagate_deadline)) {
+    fprintf(stderr, "ERROR: Deadline propagation flag must be a boolean!\n");
+    return false;
+  }
+
+  // Status may be published by the server instead of being polled
+  const char *status_topic = NULL;
+  obj = ucl_object_find_key(cfg_collector, "status_topic");
+  if (obj && !ucl_object_tostring_safe(obj, &status_topic)) {
+    fprintf(stderr, "ERROR: Status topic must be a string!\n");
+    return false;
+  }
+
   utimer_t timer_poll = timer_now();
   double poll_interval_sec;
   utimer_t poll_interval_msec;
@@ -328,6 +820,24 @@ bool start_collector(ucl_object_t *config, int log_option)
     }
   }
 
+  cfg.operators = ucl_object_find_key(cfg_collector, "operators");
+  if (cfg.operators) {
+    ucl_object_iter_t it = NULL;
+    const ucl_object_t *cfg_op;
+    while ((cfg_op = ucl_iterate_object(cfg.operators, &it, true)) != NULL) {
+      const char *op;
+      double window;
+      if (!collector_parse_operator(cfg_op, &op, &window)) {
+        fprintf(stderr, "ERROR: Operator for key '%s' must be a string or an object with a positive window!\n",
+          ucl_object_key(cfg_op));
+        return false;
+      } else if (op && !collector_find_aggregator(op)) {
+        fprintf(stderr, "ERROR: Unknown operator '%s' for key '%s'!\n", op, ucl_object_key(cfg_op));
+        return false;
+      }
+    }
+  }
+
   FILE *log_file = fopen(log_filename, "w");
   if (!log_file) {
     fprintf(stderr, "ERROR: Unable to open log file.\n");
@@ -359,83 +869,108 @@ bool start_collector(ucl_object_t *config, int log_option)
   poll_interval_msec = (long) (poll_interval_sec * 1000);
 
   int client_fd = client_connect(cfg_server);
+  if (status_topic && !client_subscribe(client_fd, status_topic))
+    return false;
+
+  // Servers that do not know the DEADLINE verb would pass it on to the device
+  bool send_deadline = propagate_deadline && !status_topic && client_server_supports(client_fd, "DEADLINE");
+  if (propagate_deadline && !status_topic && !send_deadline)
+    fprintf(stderr, "WARNING: Server does not support deadlines, not propagating them.\n");
 
   // Open the syslog facility
   openlog("koruza-collector", 0, LOG_DAEMON);
   syslog(LOG_INFO, "KORUZA collector daemon starting up.");
 
-  struct log_item_t *log_table = NULL;
+  struct collector_table_t log_table = { NULL, NULL, 0 };
+  struct client_response_t parsed;
+  client_response_init(&parsed);
   size_t state_file_size = 0;
   size_t log_file_size = 0;
   struct timespec tsp = {0, 10000000};
   size_t cmd_failures = 0;
 
   for (;;) {
-    nanosleep(&tsp, NULL);
+    char *response;
+    bool result;
+    if (status_topic) {
+      // Wait for the server to publish the next status
+      result = client_receive_push(client_fd, NULL, 0, &response);
+    } else {
+      nanosleep(&tsp, NULL);
 
-    // Periodically request data
-    if (is_timeout(&timer_poll, poll_interval_msec)) {
-      char *response;
-      DEBUG_LOG("Requesting data from server.\n");
-      if (!client_send_device_command(client_fd, status_command, &response)) {
-        syslog(LOG_WARNING, "Failed to receive data from control daeamon!");
-
-        if (++cmd_failures > 5) {
-          syslog(LOG_ERR, "Multiple failures while requesting data, reconnecting...");
-          close(client_fd);
-          client_fd = client_connect(cfg_server);
-          cmd_failures = 0;
-        }
+      // Periodically request data
+      if (!is_timeout(&timer_poll, poll_interval_msec))
         continue;
+
+      DEBUG_LOG("Requesting data from server.\n");
+      result = client_send_device_command_timeout(client_fd, status_command, timeout_msec, send_deadline, &response);
+    }
+
+    if (!result) {
+      // A late response would be taken for the response to the next request
+      bool timed_out = errno == ETIMEDOUT;
+      syslog(LOG_WARNING, "Failed to receive data from control daeamon!");
+
+      if (++cmd_failures > 5 || timed_out) {
+        syslog(LOG_ERR, "Multiple failures while requesting data, reconnecting...");
+        close(client_fd);
+        client_fd = client_connect(cfg_server);
+        if (status_topic)
+          client_subscribe(client_fd, status_topic);
+        else if (propagate_deadline)
+          send_deadline = client_server_supports(client_fd, "DEADLINE");
+        cmd_failures = 0;
       }
 
-      // Check for state file truncation -- in this case reset all state
-      struct stat stats;
-      stats.st_size = 0;
-      if (fstat(fileno(state_file), &stats) != 0 ||
-          (state_file_size > 0 && stats.st_size < state_file_size)) {
-        struct log_item_t *item, *tmp;
-        HASH_ITER(hh, log_table, item, tmp) {
-          HASH_DEL(log_table, item);
-          free(item->key);
-          free(item);
-        }
-
-        DEBUG_LOG("Reopening state file.");
-
-        // Reopen state file
-        fclose(state_file);
-        state_file = fopen(state_filename, "w");
-        if (!state_file) {
-          fprintf(stderr, "ERROR: Unable to reopen state file.\n");
-          return false;
-        }
+      if (status_topic)
+        nanosleep(&tsp, NULL);
+      continue;
+    }
+
+    // Check for state file truncation -- in this case reset all state
+    struct stat stats;
+    stats.st_size = 0;
+    if (fstat(fileno(state_file), &stats) != 0 ||
+        (state_file_size > 0 && stats.st_size < state_file_size)) {
+      collector_table_reset(&log_table);
+
+      DEBUG_LOG("Reopening state file.");
+
+      // Reopen state file
+      fclose(state_file);
+      state_file = fopen(state_filename, "w");
+      if (!state_file) {
+        fprintf(stderr, "ERROR: Unable to reopen state file.\n");
+        return false;
       }
+    }
 
-      state_file_size = stats.st_size;
-
-      // Check for log file truncation
-      stats.st_size = 0;
-      if (fstat(fileno(log_file), &stats) != 0 ||
-          (log_file_size > 0 && stats.st_size < log_file_size)) {
-        DEBUG_LOG("Reopening log file.");
-
-        // Reopen log file
-        gzclose(log_file_gz);
-        fclose(log_file);
-        log_file = fopen(log_filename, "w");
-        if (!log_file) {
-          fprintf(stderr, "ERROR: Unable to reopen log file.\n");
-          return false;
-        }
-        log_file_gz = gzdopen(fileno(log_file), "a");
+    state_file_size = stats.st_size;
+
+    // Check for log file truncation
+    stats.st_size = 0;
+    if (fstat(fileno(log_file), &stats) != 0 ||
+        (log_file_size > 0 && stats.st_size < log_file_size)) {
+      DEBUG_LOG("Reopening log file.");
+
+      // Reopen log file
+      gzclose(log_file_gz);
+      fclose(log_file);
+      log_file = fopen(log_filename, "w");
+      if (!log_file) {
+        fprintf(stderr, "ERROR: Unable to reopen log file.\n");
+        return false;
       }
+      log_file_gz = gzdopen(fileno(log_file), "a");
+    }
 
-      log_file_size = stats.st_size;
+    log_file_size = stats.st_size;
 
-      collector_parse_response(&cfg, &log_table, response, log_file_gz, state_file, last_state_file,
-        last_state_json_file);
-      free(response);
-    }
+    // Parsed response takes over the buffer
+    if (!client_parse_response(response, &parsed))
+      continue;
+
+    collector_parse_response(&cfg, &log_table, &parsed, log_file_gz, state_file, last_state_file,
+      last_state_json_file);
   }
 }
\ No newline at end of file
@@ -19,6 +19,7 @@
 #include "global.h"
 #include "controller.h"
 #include "client.h"
+#include "client_config.h"
 #include "util.h"
 
 #include <termios.h>
@@ -214,6 +215,15 @@ bool start_controller(ucl_object_t *config, bool status_only)
   if (status_only) {
     client_request_device_state(client_fd, status_command, false);
   } else {
+    // Manual commands should not wait behind background polling, servers
+    // that do not know the PRIORITY verb would pass it on to the device
+    if (client_server_supports(client_fd, "PRIORITY")) {
+      char *response;
+      if (!client_send_device_command(client_fd, "PRIORITY high\n", &response))
+        fprintf(stderr, "WARNING: Failed to raise command priority.\n");
+      free(response);
+    }
+
     fprintf(stderr, "INFO: Controller ready and accepting commands.\n");
     fprintf(stderr, "INFO: Press 'esc' to quit.\n");
 
@@ -0,0 +1,168 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "framer.h"
+
+#include <string.h>
+
+/// Frame marker lines, indexed by framing event
+static const char *framer_markers[] = {
+  [FRAMER_EVENT_START] = "#START",
+  [FRAMER_EVENT_ERROR] = "#ERROR",
+  [FRAMER_EVENT_STOP] = "#STOP",
+};
+
+#define FRAMER_MARKER_COUNT (sizeof(framer_markers) / sizeof(framer_markers[0]))
+#define FRAMER_ALL_MARKERS ((1 << FRAMER_EVENT_START) | (1 << FRAMER_EVENT_ERROR) | (1 << FRAMER_EVENT_STOP))
+
+/**
+ * Initializes the framer for a new frame.
+ *
+ * @param framer Framer state
+ */
+void framer_init(struct framer_t *framer)
+{
+  framer->line_pos = 0;
+  framer->candidates = FRAMER_ALL_MARKERS;
+  framer->cr = false;
+  framer->header = false;
+  framer->error = false;
+  framer->position = 0;
+  framer->body_start = 0;
+  framer->body_end = 0;
+}
+
+/**
+ * Completes the current line and returns the marker it matched.
+ *
+ * @param framer Framer state
+ * @return Framing event for the completed line
+ */
+static enum framer_event_t framer_end_line(struct framer_t *framer)
+{
+  enum framer_event_t event = FRAMER_EVENT_NONE;
+  size_t line_length = framer->line_pos + (framer->cr ? 2 : 1);
+  int i;
+  for (i = FRAMER_EVENT_START; i < FRAMER_MARKER_COUNT; i++) {
+    if ((framer->candidates & (1 << i)) && framer->line_pos == strlen(framer_markers[i])) {
+      event = (enum framer_event_t) i;
+      break;
+    }
+  }
+
+  framer->line_pos = 0;
+  framer->candidates = FRAMER_ALL_MARKERS;
+  framer->cr = false;
+
+  switch (event) {
+    case FRAMER_EVENT_START: framer->header = true; framer->body_start = framer->position; break;
+    case FRAMER_EVENT_ERROR: framer->header = true; framer->error = true; framer->body_start = framer->position; break;
+    case FRAMER_EVENT_STOP: framer->body_end = framer->position - line_length; break;
+    default: break;
+  }
+
+  return event;
+}
+
+/**
+ * Feeds a single byte into the framer. Marker lines may be terminated
+ * either by "\n" or "\r\n".
+ *
+ * @param framer Framer state
+ * @param byte Received byte
+ * @return Framing event triggered by this byte
+ */
+enum framer_event_t framer_feed(struct framer_t *framer, char byte)
+{
+  framer->position++;
+  if (byte == '\n')
+    return framer_end_line(framer);
+
+  if (framer->cr) {
+    // Carriage return inside a line, this cannot be a marker
+    framer->candidates = 0;
+    framer->cr = false;
+  }
+
+  if (byte == '\r') {
+    framer->cr = true;
+    return FRAMER_EVENT_NONE;
+  }
+
+  if (framer->candidates) {
+    int i;
+    for (i = FRAMER_EVENT_START; i < FRAMER_MARKER_COUNT; i++) {
+      if (!(framer->candidates & (1 << i)))
+        continue;
+
+      if (framer->line_pos >= strlen(framer_markers[i]) || framer_markers[i][framer->line_pos] != byte)
+        framer->candidates &= ~(1 << i);
+    }
+  }
+
+  framer->line_pos++;
+  return FRAMER_EVENT_NONE;
+}
+
+/**
+ * Feeds a buffer into the framer, stopping after the first byte that
+ * triggers a framing event. Lines that cannot be markers are skipped
+ * without examining each byte.
+ *
+ * @param framer Framer state
+ * @param data Received data
+ * @param length Length of received data
+ * @param event Output framing event (FRAMER_EVENT_NONE if none)
+ * @return Number of bytes consumed
+ */
+size_t framer_feed_buffer(struct framer_t *framer, const char *data, size_t length, enum framer_event_t *event)
+{
+  size_t offset = 0;
+  *event = FRAMER_EVENT_NONE;
+
+  while (offset < length) {
+    if (!framer->candidates) {
+      const char *eol = memchr(data + offset, '\n', length - offset);
+      if (!eol) {
+        framer->position += length - offset;
+        return length;
+      }
+
+      framer->position += (eol - data) - offset;
+      offset = eol - data;
+    }
+
+    *event = framer_feed(framer, data[offset++]);
+    if (*event != FRAMER_EVENT_NONE)
+      break;
+  }
+
+  return offset;
+}
+
+/**
+ * Returns true when the partially received line may still turn out to
+ * be a frame header ("#START" or "#ERROR").
+ *
+ * @param framer Framer state
+ * @return True if the current line may still be a frame header
+ */
+bool framer_in_header(const struct framer_t *framer)
+{
+  return (framer->candidates & ((1 << FRAMER_EVENT_START) | (1 << FRAMER_EVENT_ERROR))) != 0;
+}
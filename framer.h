@@ -0,0 +1,60 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_CONTROLLER_FRAMER_H
+#define KORUZA_CONTROLLER_FRAMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum framer_event_t {
+  /// No framing event
+  FRAMER_EVENT_NONE = 0,
+  /// Line "#START" has been received
+  FRAMER_EVENT_START,
+  /// Line "#ERROR" has been received
+  FRAMER_EVENT_ERROR,
+  /// Line "#STOP" has been received, frame is complete
+  FRAMER_EVENT_STOP,
+};
+
+struct framer_t {
+  /// Position within the current line
+  size_t line_pos;
+  /// Markers that the current line may still match (bitmask)
+  unsigned int candidates;
+  /// Carriage return was the last byte
+  bool cr;
+  /// Frame header has been received
+  bool header;
+  /// Frame is an error response
+  bool error;
+  /// Number of bytes fed since initialization
+  size_t position;
+  /// Position where the frame body starts
+  size_t body_start;
+  /// Position where the frame body ends
+  size_t body_end;
+};
+
+void framer_init(struct framer_t *framer);
+enum framer_event_t framer_feed(struct framer_t *framer, char byte);
+size_t framer_feed_buffer(struct framer_t *framer, const char *data, size_t length, enum framer_event_t *event);
+bool framer_in_header(const struct framer_t *framer);
+
+#endif
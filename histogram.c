@@ -0,0 +1,109 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "histogram.h"
+
+#include <string.h>
+
+/**
+ * Returns the bucket for a value. Values are grouped by their power of
+ * two, which is split into linear sub-buckets, so the relative error
+ * is bounded by the sub-bucket resolution at any magnitude.
+ *
+ * @param value Value
+ * @return Bucket index
+ */
+static unsigned int histogram_bucket(uint64_t value)
+{
+  if (value < HISTOGRAM_SUB_COUNT)
+    return value;
+
+  unsigned int exponent = 63 - __builtin_clzll(value);
+  unsigned int sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1);
+  return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + sub;
+}
+
+/**
+ * Returns the largest value that falls into a bucket.
+ *
+ * @param bucket Bucket index
+ * @return Upper bound of the bucket
+ */
+static uint64_t histogram_bucket_limit(unsigned int bucket)
+{
+  if (bucket < HISTOGRAM_SUB_COUNT)
+    return bucket;
+
+  unsigned int shift = bucket / HISTOGRAM_SUB_COUNT - 1;
+  uint64_t lower = (uint64_t) (HISTOGRAM_SUB_COUNT + bucket % HISTOGRAM_SUB_COUNT) << shift;
+  return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+/**
+ * Clears all recorded values.
+ *
+ * @param histogram Histogram
+ */
+void histogram_reset(struct histogram_t *histogram)
+{
+  memset(histogram, 0, sizeof(struct histogram_t));
+}
+
+/**
+ * Records a value.
+ *
+ * @param histogram Histogram
+ * @param value Value to record
+ */
+void histogram_record(struct histogram_t *histogram, uint64_t value)
+{
+  histogram->counts[histogram_bucket(value)]++;
+  histogram->count++;
+  histogram->sum += value;
+  if (value > histogram->max)
+    histogram->max = value;
+}
+
+/**
+ * Estimates a percentile of recorded values.
+ *
+ * @param histogram Histogram
+ * @param percentile Percentile between 0 and 100
+ * @return Upper bound of the bucket containing the percentile, 0 if
+ *   no values have been recorded
+ */
+uint64_t histogram_percentile(const struct histogram_t *histogram, double percentile)
+{
+  if (histogram->count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+
+  uint64_t seen = 0;
+  unsigned int bucket;
+  for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += histogram->counts[bucket];
+    if (seen >= rank)
+      break;
+  }
+
+  uint64_t limit = histogram_bucket_limit(bucket);
+  return limit < histogram->max ? limit : histogram->max;
+}
@@ -0,0 +1,46 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_CONTROLLER_HISTOGRAM_H
+#define KORUZA_CONTROLLER_HISTOGRAM_H
+
+#include <stdint.h>
+
+/// Number of linear sub-buckets per power of two (log2)
+#define HISTOGRAM_SUB_BITS 3
+/// Number of linear sub-buckets per power of two
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+/// Number of buckets needed to cover all 64-bit values
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram_t {
+  /// Number of recorded values in each bucket
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  /// Number of recorded values
+  uint64_t count;
+  /// Sum of recorded values
+  uint64_t sum;
+  /// Largest recorded value
+  uint64_t max;
+};
+
+void histogram_reset(struct histogram_t *histogram);
+void histogram_record(struct histogram_t *histogram, uint64_t value);
+uint64_t histogram_percentile(const struct histogram_t *histogram, double percentile);
+
+#endif
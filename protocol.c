@@ -0,0 +1,64 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "protocol.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+/**
+ * Encodes a frame header in network byte order.
+ *
+ * @param header Frame header
+ * @param buffer Output buffer of PROTOCOL_HEADER_SIZE bytes
+ */
+void protocol_header_encode(const struct protocol_header_t *header, uint8_t *buffer)
+{
+  uint32_t id = htonl(header->id);
+  uint16_t topic_length = htons(header->topic_length);
+  uint32_t length = htonl(header->length);
+
+  memcpy(buffer, &id, 4);
+  buffer[4] = header->status;
+  buffer[5] = header->flags;
+  memcpy(buffer + 6, &topic_length, 2);
+  memcpy(buffer + 8, &length, 4);
+}
+
+/**
+ * Decodes a frame header from network byte order.
+ *
+ * @param header Output frame header
+ * @param buffer Buffer of PROTOCOL_HEADER_SIZE bytes
+ */
+void protocol_header_decode(struct protocol_header_t *header, const uint8_t *buffer)
+{
+  uint32_t id;
+  uint16_t topic_length;
+  uint32_t length;
+
+  memcpy(&id, buffer, 4);
+  memcpy(&topic_length, buffer + 6, 2);
+  memcpy(&length, buffer + 8, 4);
+
+  header->id = ntohl(id);
+  header->status = buffer[4];
+  header->flags = buffer[5];
+  header->topic_length = ntohs(topic_length);
+  header->length = ntohl(length);
+}
@@ -0,0 +1,69 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_CONTROLLER_PROTOCOL_H
+#define KORUZA_CONTROLLER_PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Size of an encoded binary frame header
+#define PROTOCOL_HEADER_SIZE 12
+/// Maximum payload length of a binary request
+#define PROTOCOL_MAX_REQUEST 4096
+/// Maximum payload length of a binary response accepted by clients
+#define PROTOCOL_MAX_RESPONSE (16 * 1024 * 1024)
+
+/// Frame was published to a topic instead of answering a request
+#define PROTOCOL_FLAG_PUSH 0x01
+
+enum protocol_status_t {
+  /// Request completed successfully
+  PROTOCOL_STATUS_OK = 0,
+  /// Request failed
+  PROTOCOL_STATUS_ERROR,
+};
+
+/**
+ * Header that precedes every frame once a connection has switched to
+ * binary framing. Requests carry the command as payload, responses
+ * carry the response lines without the "#START"/"#STOP" markers. The
+ * payload of published frames starts with the topic name.
+ *
+ * Responses to requests with identifier 0 and published frames are sent
+ * in order. Responses to requests with a nonzero identifier are sent as
+ * soon as they complete, so a client may keep many requests outstanding
+ * and match responses by identifier.
+ */
+struct protocol_header_t {
+  /// Request identifier, echoed in the response (0 in published frames)
+  uint32_t id;
+  /// Response status (0 in requests)
+  uint8_t status;
+  /// Frame flags
+  uint8_t flags;
+  /// Length of the topic name at the start of payload
+  uint16_t topic_length;
+  /// Payload length, including the topic name
+  uint32_t length;
+};
+
+void protocol_header_encode(const struct protocol_header_t *header, uint8_t *buffer);
+void protocol_header_decode(struct protocol_header_t *header, const uint8_t *buffer);
+
+#endif
@@ -17,6 +17,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stddef.h>
+#include <ctype.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -29,6 +31,8 @@
 #include <termios.h>
 #include <ucl.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #include <event2/event.h>
 #include <event2/listener.h>
@@ -37,42 +41,313 @@
 
 #include "global.h"
 #include "server.h"
+#include "framer.h"
+#include "histogram.h"
+#include "protocol.h"
+#include "snapshot.h"
 #include "util.h"
 
-struct command_queue_t {
-  /// Connection that posted the command
+#include "uthash/uthash.h"
+#include "uthash/utlist.h"
+
+extern char **environ;
+
+/// Topic name under which unsolicited device messages are published
+#define EVENT_TOPIC "events"
+/// Maximum size of an unsolicited device message
+#define EVENT_MAX_SIZE 4096
+/// Number of recent response latencies kept for each command verb
+#define LATENCY_SAMPLES 64
+/// Maximum number of command verbs whose latencies are tracked
+#define LATENCY_MAX_VERBS 64
+/// Number of latencies required before the timeout adapts
+#define LATENCY_MIN_SAMPLES 16
+/// Lower bound of adaptive response timeouts (msec)
+#define TIMEOUT_MIN 200
+/// Upper bound of adaptive response timeouts (msec)
+#define TIMEOUT_MAX 30000
+/// Longest deadline accepted by the DEADLINE verb (msec)
+#define DEADLINE_MAX 86400000
+/// Number of buffer segments scanned at a time
+#define SCAN_IOVECS 8
+
+enum command_priority_t {
+  COMMAND_PRIORITY_HIGH = 0,
+  COMMAND_PRIORITY_NORMAL,
+  COMMAND_PRIORITY_LOW,
+  /// Number of priority levels
+  COMMAND_PRIORITY_COUNT
+};
+
+/// Names of priority levels as used in configuration and by clients
+const char *command_priority_names[COMMAND_PRIORITY_COUNT] = {
+  [COMMAND_PRIORITY_HIGH] = "high",
+  [COMMAND_PRIORITY_NORMAL] = "normal",
+  [COMMAND_PRIORITY_LOW] = "low",
+};
+
+enum scheduler_policy_t {
+  /// Always serve the highest priority queued command
+  SCHEDULER_POLICY_STRICT = 0,
+  /// Serve priorities in proportion to their weights
+  SCHEDULER_POLICY_WEIGHTED,
+};
+
+struct queue_stats_t {
+  /// Number of dispatched commands
+  size_t count;
+  /// Total time commands spent queued (msec)
+  utimer_t wait_total;
+  /// Maximum time a command spent queued (msec)
+  utimer_t wait_max;
+};
+
+struct latency_stats_t {
+  /// Recent response latencies (msec)
+  utimer_t samples[LATENCY_SAMPLES];
+  /// Number of recorded latencies
+  size_t count;
+  /// Index of the latency to be replaced next
+  size_t next;
+  /// Response timeout derived from recorded latencies (msec)
+  utimer_t timeout;
+};
+
+struct command_metrics_t {
+  /// Number of commands that timed out
+  uint64_t timeouts;
+  /// Time commands spent queued (usec)
+  struct histogram_t queue_wait;
+  /// Time to transmit commands to the device (usec)
+  struct histogram_t transmit;
+  /// Time from transmission to the first response byte (usec)
+  struct histogram_t first_byte;
+  /// Time from transmission to the end of response (usec)
+  struct histogram_t response;
+  /// Response sizes (bytes)
+  struct histogram_t response_bytes;
+};
+
+struct verb_stats_t {
+  /// Command verb
+  char *verb;
+  /// Response latencies of commands with this verb
+  struct latency_stats_t latency;
+  /// Instrumentation of commands with this verb
+  struct command_metrics_t metrics;
+
+  UT_hash_handle hh;
+};
+
+struct command_class_t {
+  /// Class name
+  const char *name;
+  /// Command prefix that selects this class
+  const char *prefix;
+  /// Command prefix length
+  size_t prefix_length;
+  /// Commands in this class have no side effects on the device
+  bool read_only;
+  /// Time for which responses to read-only commands may be cached (msec)
+  utimer_t cache_ttl;
+  /// Scheduling priority
+  enum command_priority_t priority;
+  /// Fixed response timeout overriding the adaptive one (msec, 0 if none)
+  utimer_t timeout;
+  /// Next command class
+  struct command_class_t *next;
+};
+
+struct command_waiter_t {
+  /// Connection waiting for the response
+  struct connection_context_t *connection;
+  /// Command the connection is waiting for (NULL when complete)
+  struct command_queue_t *command;
+  /// Response held back until earlier responses are sent (can be NULL)
+  struct evbuffer *pending;
+  /// Request identifier echoed in binary frames
+  uint32_t id;
+  /// Response is sent as soon as it is complete, regardless of order
+  bool unordered;
+  /// Topic the response is published to (binary connections only, can be NULL)
+  const char *topic;
+  /// Time after which nobody reads the response (msec, 0 if none)
+  utimer_t deadline;
+  /// Previous waiter for the same command
+  struct command_waiter_t *prev;
+  /// Next waiter for the same command
+  struct command_waiter_t *next;
+  /// Previous command the same connection is waiting for
+  struct command_waiter_t *conn_prev;
+  /// Next command the same connection is waiting for
+  struct command_waiter_t *conn_next;
+};
+
+struct subscription_t {
+  /// Subscribed connection
   struct connection_context_t *connection;
+  /// Topic the connection is subscribed to
+  struct topic_t *topic;
+  /// Previous subscriber to the same topic
+  struct subscription_t *prev;
+  /// Next subscriber to the same topic
+  struct subscription_t *next;
+  /// Previous subscription of the same connection
+  struct subscription_t *conn_prev;
+  /// Next subscription of the same connection
+  struct subscription_t *conn_next;
+};
+
+struct topic_t {
+  /// Topic name
+  const char *name;
+  /// Command that is periodically published
+  const char *command;
+  /// Command length
+  size_t cmd_length;
+  /// Publishing interval
+  struct timeval interval;
+  /// Server context
+  struct server_context_t *server;
+  /// Publishing timer
+  struct event *timer;
+  /// Subscribed connections
+  struct subscription_t *subscribers;
+  /// Command whose response is being published (can be NULL)
+  struct command_queue_t *pending;
+  /// Next topic
+  struct topic_t *next;
+};
+
+struct command_queue_t {
+  /// Connections that posted the command
+  struct command_waiter_t *waiters;
+  /// Topic the response is published to (can be NULL)
+  struct topic_t *topic;
+  /// True if the response is also needed by the server itself
+  bool internal;
   /// Queued command
   char *command;
   /// Command lengtgh
   size_t cmd_length;
+  /// Command class (can be NULL)
+  struct command_class_t *cls;
+  /// Scheduling priority
+  enum command_priority_t priority;
+  /// Time when the command was queued (usec)
+  utimer_t queued_usec;
+  /// Time when the command was sent to the device (usec, 0 if not sent)
+  utimer_t sent_usec;
+  /// Time when the command was fully transmitted (usec)
+  utimer_t transmitted_usec;
+  /// Time when the first response byte was received (usec)
+  utimer_t first_byte_usec;
+  /// Previous command in queue
+  struct command_queue_t *prev;
   /// Next command in queue
   struct command_queue_t *next;
 };
 
+struct response_cache_t {
+  /// Cached command
+  char *command;
+  /// Command length
+  size_t cmd_length;
+  /// Cached response body
+  struct evbuffer *response;
+  /// Time when the response was received
+  utimer_t timestamp;
+
+  UT_hash_handle hh;
+};
+
 struct server_context_t {
   /// Event base
   struct event_base *base;
   /// Request timeout event
   struct event *timeout_event;
-  /// Currently active connection (can be NULL)
-  struct connection_context_t *active_connection;
-  /// Command queue start
-  struct command_queue_t *cmd_queue_start;
-  /// Command queue tail
-  struct command_queue_t *cmd_queue_tail;
+  /// Serial port reopen retry event
+  struct event *reopen_event;
+  /// Currently active command (can be NULL)
+  struct command_queue_t *active_command;
+  /// Command queue for each priority
+  struct command_queue_t *cmd_queue[COMMAND_PRIORITY_COUNT];
+  /// Number of queued commands cancelled as their connections went away
+  size_t cancelled_commands;
+  /// Number of queued commands dropped as their deadlines expired
+  size_t expired_commands;
+  /// Scheduling policy
+  enum scheduler_policy_t scheduler_policy;
+  /// Scheduling weights for each priority
+  int64_t scheduler_weights[COMMAND_PRIORITY_COUNT];
+  /// Remaining scheduling credits for each priority
+  int64_t scheduler_credits[COMMAND_PRIORITY_COUNT];
+  /// Queue wait statistics for each priority
+  struct queue_stats_t queue_stats[COMMAND_PRIORITY_COUNT];
+  /// Initial response timeout (msec)
+  utimer_t response_timeout;
+  /// Latencies and instrumentation by command verb
+  struct verb_stats_t *verb_stats;
+  /// Instrumentation of commands whose verb is not tracked
+  struct command_metrics_t metrics;
+  /// Listener for metrics scrapes (can be NULL)
+  struct evconnlistener *metrics_listener;
   /// Serial device inode path
   const char *serial_device;
   /// Serial device buffer
   struct bufferevent *serial_bev;
   /// Serial port configuration
   struct termios serial_tio;
-  /// Current response buffer
-  char *response;
+  /// Response data being forwarded to waiting connections
+  struct evbuffer *rsp_chunk;
+  /// Complete response (only collected for cacheable commands)
+  struct evbuffer *response;
   /// Response length
   size_t rsp_length;
+  /// Frame body being extracted
+  struct evbuffer *frame_body;
+  /// Response framing state
+  struct framer_t framer;
   /// Device reset hook
   const char *hook_device_reset;
+  /// Process running the device reset hook (-1 if none)
+  pid_t reset_pid;
+  /// Time when the device reset hook was started
+  utimer_t reset_timestamp;
+  /// Device reset hook duration statistics
+  struct queue_stats_t reset_stats;
+  /// Configured command classes
+  struct command_class_t *command_classes;
+  /// Cached responses to read-only commands
+  struct response_cache_t *response_cache;
+  /// Number of active or queued commands with side effects
+  size_t pending_writes;
+  /// Configured topics
+  struct topic_t *topics;
+  /// Unsolicited message being received
+  struct evbuffer *event_frame;
+  /// Unsolicited message framing state
+  struct framer_t event_framer;
+  /// Recently received unsolicited messages (ring buffer)
+  struct evbuffer **event_ring;
+  /// Capacity of the unsolicited message ring buffer
+  size_t event_ring_size;
+  /// Index of the oldest message in the ring buffer
+  size_t event_ring_start;
+  /// Number of messages in the ring buffer
+  size_t event_ring_count;
+  /// Connections subscribed to unsolicited messages
+  struct connection_context_t *event_listeners;
+  /// Shared memory status snapshot (can be NULL)
+  struct snapshot_region_t *snapshot;
+  /// Command whose responses are published to the snapshot
+  const char *snapshot_command;
+  /// Snapshot command length
+  size_t snapshot_cmd_length;
+  /// Snapshot refresh interval
+  struct timeval snapshot_interval;
+  /// Snapshot refresh timer (can be NULL)
+  struct event *snapshot_timer;
 };
 
 struct connection_context_t {
@@ -84,13 +359,46 @@ struct connection_context_t {
   char command[64];
   /// Current command length
   size_t cmd_length;
+  /// Connection uses binary framing
+  bool binary;
+  /// Identifier of the request being processed (0 if none)
+  uint32_t request_id;
+  /// Priority declared by the client (-1 if none)
+  int priority;
+  /// Deadline for the next command posted by the connection (msec, 0 if none)
+  utimer_t deadline;
+  /// Commands this connection is waiting for
+  struct command_waiter_t *waiters;
+  /// Topics this connection is subscribed to
+  struct subscription_t *subscriptions;
+  /// Connection is subscribed to unsolicited messages
+  bool event_listener;
+  /// Previous connection subscribed to unsolicited messages
+  struct connection_context_t *event_prev;
+  /// Next connection subscribed to unsolicited messages
+  struct connection_context_t *event_next;
 };
 
 // Forward declarations
-void server_serial_start_response_timer(struct server_context_t *server, int timeout);
+void server_serial_start_response_timer(struct server_context_t *server, utimer_t timeout);
+void server_serial_start_reopen_timer(struct server_context_t *server, utimer_t timeout);
 void server_serial_read_cb(struct bufferevent *bev, void *ctx);
 void server_serial_event_cb(struct bufferevent *bev, short events, void *ctx);
-void server_serial_send_command(struct server_context_t *server, const char *command, size_t length);
+void server_serial_write_cb(struct bufferevent *bev, void *ctx);
+void server_metrics_reset(struct command_metrics_t *metrics);
+void server_serial_send_command(struct server_context_t *server, const char *command, size_t length, utimer_t timeout);
+void server_command_remove_waiter(struct server_context_t *server, struct command_waiter_t *waiter);
+void server_waiter_free(struct command_waiter_t *waiter);
+bool server_command_is_read_only(struct command_queue_t *cmd);
+bool server_command_is_cacheable(struct command_queue_t *cmd);
+bool server_command_is_snapshot(struct server_context_t *server, struct command_queue_t *cmd);
+void server_serial_dispatch_command(struct server_context_t *server, struct command_queue_t *cmd);
+void server_subscription_free(struct subscription_t *subscription);
+void server_command_submit(struct server_context_t *server, struct command_queue_t *cmd);
+bool server_event_in_progress(struct server_context_t *server);
+bool server_event_subscribe(struct connection_context_t *connection, struct evbuffer *output);
+size_t server_response_scan(struct framer_t *framer, struct evbuffer *input, bool *done);
+void server_verb_list(struct evbuffer *output);
 
 /**
  * Creates a new connection context.
@@ -107,6 +415,15 @@ struct connection_context_t *connection_context_new(struct server_context_t *ser
   ctx->server = server;
   memset(ctx->command, 0, sizeof(ctx->command));
   ctx->cmd_length = 0;
+  ctx->binary = false;
+  ctx->request_id = 0;
+  ctx->priority = -1;
+  ctx->deadline = 0;
+  ctx->waiters = NULL;
+  ctx->subscriptions = NULL;
+  ctx->event_listener = false;
+  ctx->event_prev = NULL;
+  ctx->event_next = NULL;
   return ctx;
 }
 
@@ -120,225 +437,2338 @@ void connection_context_free(struct connection_context_t *ctx)
   if (!ctx)
     return;
 
-  if (ctx->server->active_connection == ctx) {
-    // The connection that we are freeing is a currently active connection
-    ctx->server->active_connection = NULL;
+  // Stop waiting for responses, queued commands nobody waits for are cancelled
+  struct command_waiter_t *waiter, *tmp;
+  DL_FOREACH_SAFE2(ctx->waiters, waiter, tmp, conn_next) {
+    server_command_remove_waiter(ctx->server, waiter);
+  }
+
+  struct subscription_t *subscription, *stmp;
+  DL_FOREACH_SAFE2(ctx->subscriptions, subscription, stmp, conn_next) {
+    server_subscription_free(subscription);
   }
 
+  if (ctx->event_listener)
+    DL_DELETE2(ctx->server->event_listeners, ctx, event_prev, event_next);
+
   bufferevent_free(ctx->conn_bev);
   free(ctx);
 }
 
 /**
- * Sends a command to the serial device. If another command is
- * currently being processed, the command is queued for later
- * transmission.
+ * Finds the command class with the longest prefix matching the
+ * given command.
  *
- * @param connection Connection context
- * @param command Command to send
+ * @param server Server context
+ * @param command Command string
  * @param size Length of command string
- * @return True on success, false if something went wrong
+ * @return Matching command class or NULL if there is none
  */
-bool server_send_command(struct connection_context_t *connection, const char *command, size_t size)
+struct command_class_t *server_find_command_class(struct server_context_t *server, const char *command, size_t size)
 {
-  struct server_context_t *server = connection->server;
+  struct command_class_t *cls, *match = NULL;
+  for (cls = server->command_classes; cls != NULL; cls = cls->next) {
+    if (cls->prefix_length > size || strncmp(command, cls->prefix, cls->prefix_length) != 0)
+      continue;
 
-  if (server->active_connection != NULL) {
-    // Queue command
-    struct command_queue_t *cmd = (struct command_queue_t*) malloc(sizeof(struct command_queue_t));
-    if (!cmd) {
-      syslog(LOG_ERR, "Failed to allocate command context, dropping connection.");
-      connection_context_free(connection);
-      return false;
+    if (!match || cls->prefix_length > match->prefix_length)
+      match = cls;
+  }
+
+  return match;
+}
+
+/**
+ * Creates a new command context.
+ *
+ * @param command Command string
+ * @param size Length of command string
+ * @param cls Command class (can be NULL)
+ * @param priority Scheduling priority
+ * @return Newly created command context
+ */
+struct command_queue_t *server_command_new(const char *command,
+                                           size_t size,
+                                           struct command_class_t *cls,
+                                           enum command_priority_t priority)
+{
+  struct command_queue_t *cmd = (struct command_queue_t*) malloc(sizeof(struct command_queue_t));
+  if (!cmd)
+    return NULL;
+
+  cmd->command = strndup(command, size);
+  if (!cmd->command) {
+    free(cmd);
+    return NULL;
+  }
+
+  cmd->waiters = NULL;
+  cmd->topic = NULL;
+  cmd->internal = false;
+  cmd->cmd_length = size;
+  cmd->cls = cls;
+  cmd->priority = priority;
+  cmd->queued_usec = timer_now_usec();
+  cmd->sent_usec = 0;
+  cmd->transmitted_usec = 0;
+  cmd->first_byte_usec = 0;
+  cmd->prev = NULL;
+  cmd->next = NULL;
+  return cmd;
+}
+
+/**
+ * Returns true if the response to the request currently processed by
+ * the connection may be sent before responses to earlier requests. This
+ * is the case for binary requests with a nonzero identifier, as clients
+ * can match responses by identifier.
+ *
+ * @param connection Connection context
+ * @return True if the response may be sent out of order
+ */
+bool server_connection_unordered(struct connection_context_t *connection)
+{
+  return connection->binary && connection->request_id != 0;
+}
+
+/**
+ * Creates a new waiter at the end of the connection's list of pending
+ * responses. Responses are sent in the order that the connection posted
+ * the commands, so the response for any but the first waiter is held
+ * back, unless the response may be sent out of order.
+ *
+ * @param connection Connection context
+ * @return Newly created waiter
+ */
+struct command_waiter_t *server_waiter_new(struct connection_context_t *connection)
+{
+  struct command_waiter_t *waiter = (struct command_waiter_t*) malloc(sizeof(struct command_waiter_t));
+  if (!waiter)
+    return NULL;
+
+  waiter->connection = connection;
+  waiter->command = NULL;
+  waiter->pending = NULL;
+  waiter->id = connection->request_id;
+  waiter->unordered = server_connection_unordered(connection);
+  waiter->topic = NULL;
+  waiter->deadline = 0;
+  waiter->prev = NULL;
+  waiter->next = NULL;
+
+  // Binary frames are only sent once the response is complete
+  if (connection->waiters != NULL || connection->binary) {
+    waiter->pending = evbuffer_new();
+    if (!waiter->pending) {
+      free(waiter);
+      return NULL;
     }
-    cmd->connection = connection;
-    cmd->command = strdup(command);
-    cmd->cmd_length = size;
-    cmd->next = NULL;
+  }
 
-    if (server->cmd_queue_tail == NULL) {
-      server->cmd_queue_start = cmd;
-    } else {
-      server->cmd_queue_tail->next = cmd;
+  DL_APPEND2(connection->waiters, waiter, conn_prev, conn_next);
+  return waiter;
+}
+
+/**
+ * Frees the waiter, removing it from its connection. The waiter must
+ * not be waiting for a command.
+ *
+ * @param waiter Waiter to free
+ */
+void server_waiter_free(struct command_waiter_t *waiter)
+{
+  DL_DELETE2(waiter->connection->waiters, waiter, conn_prev, conn_next);
+  if (waiter->pending)
+    evbuffer_free(waiter->pending);
+  free(waiter);
+}
+
+/**
+ * Returns the buffer that response data for the waiter should be
+ * written to.
+ *
+ * @param waiter Waiter
+ * @return Connection output buffer for the first waiter of a text
+ *   connection, otherwise the buffer with held back response data
+ */
+struct evbuffer *server_waiter_output(struct command_waiter_t *waiter)
+{
+  if (waiter == waiter->connection->waiters && !waiter->connection->binary)
+    return bufferevent_get_output(waiter->connection->conn_bev);
+
+  return waiter->pending;
+}
+
+/**
+ * Sends held back responses that are no longer preceded by incomplete
+ * ones, and complete responses that may be sent out of order.
+ *
+ * @param connection Connection context
+ */
+void server_connection_flush(struct connection_context_t *connection)
+{
+  struct evbuffer *output = bufferevent_get_output(connection->conn_bev);
+  struct command_waiter_t *waiter, *tmp;
+  bool blocked = false;
+  DL_FOREACH_SAFE2(connection->waiters, waiter, tmp, conn_next) {
+    // Responses that may be sent out of order neither wait for nor block others
+    if (blocked && !waiter->unordered)
+      continue;
+
+    if (waiter->command != NULL) {
+      // The first incomplete text response is written directly from now on,
+      // while incomplete binary frames are held back until the body is known
+      if (!waiter->unordered) {
+        if (!connection->binary && waiter->pending)
+          evbuffer_add_buffer(output, waiter->pending);
+        blocked = true;
+      }
+      continue;
     }
 
-    server->cmd_queue_tail = cmd;
+    if (waiter->pending)
+      evbuffer_add_buffer(output, waiter->pending);
+    server_waiter_free(waiter);
+  }
+}
 
-    DEBUG_LOG("DEBUG: Command queued.\n");
-  } else {
-    // Write command immediately
-    server->active_connection = connection;
-    server_serial_send_command(server, command, size);
+/**
+ * Marks the waiter's response as complete.
+ *
+ * @param waiter Waiter
+ */
+void server_waiter_complete(struct command_waiter_t *waiter)
+{
+  DL_DELETE(waiter->command->waiters, waiter);
+  waiter->command = NULL;
+
+  server_connection_flush(waiter->connection);
+}
+
+/**
+ * Returns the buffer that a response generated by the server itself
+ * should be written to, keeping responses in order unless the response
+ * may be sent out of order.
+ *
+ * @param connection Connection context
+ * @return Output buffer or NULL if something went wrong
+ */
+struct evbuffer *server_connection_reply_output(struct connection_context_t *connection)
+{
+  if (connection->waiters == NULL || server_connection_unordered(connection))
+    return bufferevent_get_output(connection->conn_bev);
+
+  struct command_waiter_t *waiter = server_waiter_new(connection);
+  if (!waiter)
+    return NULL;
+
+  return waiter->pending;
+}
+
+/**
+ * Writes the start of a response frame in the connection's framing
+ * mode. Text frames start with the "#START" or "#ERROR" marker, preceded
+ * by a line naming the topic for published frames, while binary frames
+ * start with a header announcing the body length.
+ *
+ * @param connection Connection context
+ * @param output Output buffer
+ * @param id Request identifier (ignored for published frames)
+ * @param topic Topic the frame is published to (can be NULL)
+ * @param error True for an error response
+ * @param length Body length
+ */
+void server_frame_begin(struct connection_context_t *connection,
+                        struct evbuffer *output,
+                        uint32_t id,
+                        const char *topic,
+                        bool error,
+                        size_t length)
+{
+  if (!connection->binary) {
+    if (topic)
+      evbuffer_add_printf(output, "#PUSH %s\r\n", topic);
+    evbuffer_add(output, error ? "#ERROR\r\n" : "#START\r\n", 8);
+    return;
   }
 
-  return true;
+  struct protocol_header_t header;
+  header.id = topic ? 0 : id;
+  header.status = error ? PROTOCOL_STATUS_ERROR : PROTOCOL_STATUS_OK;
+  header.flags = topic ? PROTOCOL_FLAG_PUSH : 0;
+  header.topic_length = topic ? strlen(topic) : 0;
+  header.length = header.topic_length + length;
+
+  uint8_t buffer[PROTOCOL_HEADER_SIZE];
+  protocol_header_encode(&header, buffer);
+  evbuffer_add(output, buffer, sizeof(buffer));
+  if (topic)
+    evbuffer_add(output, topic, header.topic_length);
 }
 
 /**
- * Callback for connection read events.
+ * Writes the end of a response frame in the connection's framing mode.
  *
- * @param bev Buffer event
- * @param ctx Connection context
+ * @param connection Connection context
+ * @param output Output buffer
  */
-void server_connection_read_cb(struct bufferevent *bev, void *ctx)
+void server_frame_end(struct connection_context_t *connection, struct evbuffer *output)
 {
-  struct connection_context_t *connection = (struct connection_context_t*) ctx;
-  int n = bufferevent_read(bev, connection->command + connection->cmd_length, 64 - connection->cmd_length);
-  if (n <= 0)
+  if (!connection->binary)
+    evbuffer_add(output, "#STOP\r\n", 7);
+}
+
+/**
+ * Writes a complete response frame to the request currently processed
+ * by the connection or to a topic. Body data is shared by reference
+ * instead of being copied.
+ *
+ * @param connection Connection context
+ * @param output Output buffer
+ * @param topic Topic the frame is published to (can be NULL)
+ * @param error True for an error response
+ * @param body Response body (can be NULL)
+ */
+void server_frame_write(struct connection_context_t *connection,
+                        struct evbuffer *output,
+                        const char *topic,
+                        bool error,
+                        struct evbuffer *body)
+{
+  size_t length = body ? evbuffer_get_length(body) : 0;
+  server_frame_begin(connection, output, connection->request_id, topic, error, length);
+  if (length > 0)
+    evbuffer_add_buffer_reference(output, body);
+  server_frame_end(connection, output);
+}
+
+/**
+ * Moves the body of a complete text frame to another buffer, dropping
+ * the frame markers and anything outside of them.
+ *
+ * @param framer Framing state of the complete frame
+ * @param frame Buffer with the frame
+ * @param body Output buffer for the body
+ */
+void server_frame_extract(struct framer_t *framer, struct evbuffer *frame, struct evbuffer *body)
+{
+  evbuffer_drain(frame, framer->body_start);
+  evbuffer_remove_buffer(frame, body, framer->body_end - framer->body_start);
+  evbuffer_drain(frame, evbuffer_get_length(frame));
+}
+
+/**
+ * Replaces the device response held back for a binary connection with
+ * a binary frame carrying the response body.
+ *
+ * @param waiter Waiter
+ * @param framer Framing state of the complete response
+ */
+void server_waiter_encode(struct command_waiter_t *waiter, struct framer_t *framer)
+{
+  struct evbuffer *body = waiter->connection->server->frame_body;
+  server_frame_extract(framer, waiter->pending, body);
+  server_frame_begin(waiter->connection, waiter->pending, waiter->id, waiter->topic, framer->error,
+    evbuffer_get_length(body));
+  evbuffer_add_buffer(waiter->pending, body);
+}
+
+/**
+ * Frees the command context.
+ *
+ * @param cmd Command context
+ */
+void server_command_free(struct command_queue_t *cmd)
+{
+  if (!cmd)
     return;
 
-  connection->cmd_length += n;
-  if (connection->cmd_length >= 64) {
-    syslog(LOG_ERR, "Protocol error, command too long.");
+  struct command_waiter_t *waiter, *tmp;
+  DL_FOREACH_SAFE(cmd->waiters, waiter, tmp) {
+    server_waiter_free(waiter);
+  }
 
-    // Close the connection
-    connection_context_free(connection);
+  // Topic may be published again
+  if (cmd->topic)
+    cmd->topic->pending = NULL;
+
+  free(cmd->command);
+  free(cmd);
+}
+
+/**
+ * Registers a connection as waiting for the command response.
+ *
+ * @param cmd Command context
+ * @param connection Connection context
+ * @return Newly created waiter or NULL if something went wrong
+ */
+struct command_waiter_t *server_command_add_waiter(struct command_queue_t *cmd, struct connection_context_t *connection)
+{
+  struct command_waiter_t *waiter = server_waiter_new(connection);
+  if (!waiter)
+    return NULL;
+
+  waiter->command = cmd;
+  DL_APPEND(cmd->waiters, waiter);
+  return waiter;
+}
+
+/**
+ * Removes a connection from the list of connections waiting for the
+ * command response. A queued command that nobody is waiting for
+ * anymore is cancelled, unless its response is also published to a
+ * topic or needed by the server itself.
+ *
+ * @param server Server context
+ * @param waiter Waiter to remove
+ */
+void server_command_remove_waiter(struct server_context_t *server, struct command_waiter_t *waiter)
+{
+  struct command_queue_t *cmd = waiter->command;
+  if (cmd)
+    DL_DELETE(cmd->waiters, waiter);
+  server_waiter_free(waiter);
+
+  if (!cmd || cmd->waiters != NULL || cmd->topic != NULL || cmd->internal || cmd == server->active_command)
     return;
-  } else if (connection->command[connection->cmd_length - 1] == '\n') {
-    DEBUG_LOG("DEBUG: Got command: %s", connection->command);
 
-    // Command has been parsed, send (or queue)
-    if (!server_send_command(connection, connection->command, connection->cmd_length))
-      return;
+  DEBUG_LOG("DEBUG: Cancelling queued command: %s", cmd->command);
 
-    memset(connection->command, 0, sizeof(connection->command));
-    connection->cmd_length = 0;
+  DL_DELETE(server->cmd_queue[cmd->priority], cmd);
+  if (!server_command_is_read_only(cmd))
+    server->pending_writes--;
+
+  server->cancelled_commands++;
+  server_command_free(cmd);
+}
+
+/**
+ * Completes the responses of all connections waiting for the command.
+ * Responses to binary connections are framed once the body is known.
+ *
+ * @param cmd Command context
+ * @param framer Framing state of the complete response
+ */
+void server_command_complete(struct command_queue_t *cmd, struct framer_t *framer)
+{
+  struct command_waiter_t *waiter, *tmp;
+  DL_FOREACH_SAFE(cmd->waiters, waiter, tmp) {
+    if (waiter->connection->binary)
+      server_waiter_encode(waiter, framer);
+    server_waiter_complete(waiter);
   }
 }
 
 /**
- * Callback for connection exceptional events.
+ * Sends an error response to the waiter and marks it as complete.
  *
- * @param bev Buffer event
- * @param events Event mask
- * @param ctx Connection context
+ * @param waiter Waiter
  */
-void server_connection_event_cb(struct bufferevent *bev, short events, void *ctx)
+void server_waiter_fail(struct command_waiter_t *waiter)
 {
-  struct connection_context_t *connection = (struct connection_context_t*) ctx;
+  struct evbuffer *output = server_waiter_output(waiter);
 
-  if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
-    syslog(LOG_INFO, "Connection closed.");
-    connection_context_free(connection);
+  // Binary connections have not seen the partial response yet
+  if (waiter->connection->binary)
+    evbuffer_drain(output, evbuffer_get_length(output));
+
+  server_frame_begin(waiter->connection, output, waiter->id, waiter->topic, true, 0);
+  server_frame_end(waiter->connection, output);
+  server_waiter_complete(waiter);
+}
+
+/**
+ * Fails the command, sending an error response to all connections
+ * waiting for it.
+ *
+ * @param cmd Command context
+ */
+void server_command_fail(struct command_queue_t *cmd)
+{
+  struct command_waiter_t *waiter, *tmp;
+  DL_FOREACH_SAFE(cmd->waiters, waiter, tmp) {
+    server_waiter_fail(waiter);
   }
 }
 
 /**
- * Callback for accepting new connections.
+ * Fails waiters of a dequeued command whose deadlines have expired, as
+ * their clients no longer read the response. The command is dropped
+ * instead of being sent to the device when all of its waiters expired
+ * and neither a topic nor the server itself needs the response.
  *
- * @param listener Connection listener
- * @param fd Accepted connection file descriptor
- * @param address Remote address
- * @param ctx Server context
+ * @param server Server context
+ * @param cmd Command context
+ * @return True if the command has been dropped
  */
-void server_accept_conn_cb(struct evconnlistener *listener,
-                           evutil_socket_t fd,
-                           struct sockaddr *address,
-                           int socklen,
-                           void *ctx)
+bool server_command_expire(struct server_context_t *server, struct command_queue_t *cmd)
 {
-  struct server_context_t *server = (struct server_context_t*) ctx;
+  utimer_t now = timer_now();
+  bool expired = false;
+  struct command_waiter_t *waiter, *tmp;
+  DL_FOREACH_SAFE(cmd->waiters, waiter, tmp) {
+    if (waiter->deadline > 0 && waiter->deadline <= now) {
+      server_waiter_fail(waiter);
+      expired = true;
+    }
+  }
 
-  struct connection_context_t *connection = connection_context_new(server);
-  if (!connection) {
-    syslog(LOG_ERR, "Failed to allocate connection context, dropping connection.");
-    // TODO close connection?
+  if (!expired || cmd->waiters != NULL || cmd->topic != NULL || cmd->internal)
+    return false;
+
+  DEBUG_LOG("DEBUG: Dropping expired command: %s", cmd->command);
+
+  if (!server_command_is_read_only(cmd))
+    server->pending_writes--;
+
+  server->expired_commands++;
+  server_command_free(cmd);
+  return true;
+}
+
+/**
+ * Forwards response data to all connections waiting for the active
+ * command. Data is moved between buffers and shared by reference
+ * instead of being copied.
+ *
+ * @param server Server context
+ * @param input Buffer with response data
+ * @param length Number of bytes at the start of the buffer to forward
+ */
+void server_command_forward(struct server_context_t *server, struct evbuffer *input, size_t length)
+{
+  struct command_queue_t *cmd = server->active_command;
+  struct command_waiter_t *waiter = cmd->waiters;
+  bool collect = server_command_is_cacheable(cmd) || server_command_is_snapshot(server, cmd);
+
+  if (length < evbuffer_get_length(input)) {
+    // Only part of the buffer belongs to this response
+    evbuffer_remove_buffer(input, server->rsp_chunk, length);
+    input = server->rsp_chunk;
+  }
+
+  if (waiter && !waiter->next && !collect) {
+    // Single recipient, hand over the data directly
+    evbuffer_add_buffer(server_waiter_output(waiter), input);
     return;
   }
 
-  struct event_base *base = evconnlistener_get_base(listener);
-  connection->conn_bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
-  bufferevent_setcb(connection->conn_bev, server_connection_read_cb, NULL, server_connection_event_cb, connection);
-  bufferevent_enable(connection->conn_bev, EV_READ | EV_WRITE);
+  // Multiple recipients reference the same data
+  if (input != server->rsp_chunk)
+    evbuffer_add_buffer(server->rsp_chunk, input);
+  for (; waiter != NULL; waiter = waiter->next) {
+    evbuffer_add_buffer_reference(server_waiter_output(waiter), server->rsp_chunk);
+  }
 
-  syslog(LOG_INFO, "Accepted new connection.");
+  if (collect)
+    evbuffer_add_buffer(server->response, server->rsp_chunk);
+  else
+    evbuffer_drain(server->rsp_chunk, evbuffer_get_length(server->rsp_chunk));
 }
 
-void server_serial_command_done(struct server_context_t *server)
+/**
+ * Finds an identical read-only command that is either active (with no
+ * response received so far) or queued with the same priority, so that
+ * its response can be shared. Commands queued before a command with
+ * side effects are not considered as their response would not reflect
+ * its outcome.
+ *
+ * @param server Server context
+ * @param command Command string
+ * @param size Length of command string
+ * @param priority Queue to search
+ * @return Matching command context or NULL if there is none
+ */
+struct command_queue_t *server_find_pending_command(struct server_context_t *server,
+                                                    const char *command,
+                                                    size_t size,
+                                                    enum command_priority_t priority)
 {
-  server->rsp_length = 0;
+  struct command_queue_t *cmd, *match = NULL;
 
-  // Cancel response timeout timer
-  if (server->timeout_event)
-    evtimer_del(server->timeout_event);
+  cmd = server->active_command;
+  if (cmd && server->rsp_length == 0 && cmd->cls && cmd->cls->read_only &&
+      cmd->cmd_length == size && memcmp(cmd->command, command, size) == 0) {
+    match = cmd;
+  }
+
+  DL_FOREACH(server->cmd_queue[priority], cmd) {
+    if (!cmd->cls || !cmd->cls->read_only)
+      match = NULL;
+    else if (cmd->cmd_length == size && memcmp(cmd->command, command, size) == 0)
+      match = cmd;
+  }
+
+  return match;
+}
+
+/**
+ * Returns true if the command has no side effects on the device.
+ *
+ * @param cmd Command context
+ * @return True if the command is read-only
+ */
+bool server_command_is_read_only(struct command_queue_t *cmd)
+{
+  return cmd->cls && cmd->cls->read_only;
+}
+
+/**
+ * Returns true if the response to the command should be cached.
+ *
+ * @param cmd Command context
+ * @return True if the command is cacheable
+ */
+bool server_command_is_cacheable(struct command_queue_t *cmd)
+{
+  return server_command_is_read_only(cmd) && cmd->cls->cache_ttl > 0;
+}
+
+/**
+ * Returns true if the response to the command should be published to
+ * the shared memory status snapshot.
+ *
+ * @param server Server context
+ * @param cmd Command context
+ * @return True if the command is the snapshot command
+ */
+bool server_command_is_snapshot(struct server_context_t *server, struct command_queue_t *cmd)
+{
+  return server->snapshot && cmd->cmd_length == server->snapshot_cmd_length &&
+    memcmp(cmd->command, server->snapshot_command, cmd->cmd_length) == 0;
+}
+
+/**
+ * Publishes the response to the currently active command to the shared
+ * memory status snapshot when it is the snapshot command.
+ *
+ * @param server Server context
+ */
+void server_snapshot_store(struct server_context_t *server)
+{
+  if (!server_command_is_snapshot(server, server->active_command) || server->framer.error)
+    return;
+
+  size_t length = evbuffer_get_length(server->response);
+  const char *response = (const char*) evbuffer_pullup(server->response, length);
+  if (response)
+    snapshot_update(server->snapshot, response, length);
+}
+
+/**
+ * Timer callback that refreshes the status snapshot by sending the
+ * snapshot command, unless an identical command is already pending.
+ *
+ * @param fd Unused
+ * @param events Event mask
+ * @param ctx Server context
+ */
+void server_snapshot_refresh_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct server_context_t *server = (struct server_context_t*) ctx;
+  struct command_class_t *cls = server_find_command_class(server, server->snapshot_command, server->snapshot_cmd_length);
+  enum command_priority_t priority = cls ? cls->priority : COMMAND_PRIORITY_NORMAL;
+
+  // The pending command must be kept even when its waiters go away
+  struct command_queue_t *cmd = server_find_pending_command(server, server->snapshot_command,
+    server->snapshot_cmd_length, priority);
+  if (cmd) {
+    cmd->internal = true;
+    return;
+  }
+
+  // Nobody waits for the response, it is only published to the snapshot
+  cmd = server_command_new(server->snapshot_command, server->snapshot_cmd_length, cls, priority);
+  if (!cmd) {
+    syslog(LOG_ERR, "Failed to allocate command context, skipping snapshot refresh.");
+    return;
+  }
+
+  cmd->internal = true;
+
+  server_command_submit(server, cmd);
+}
+
+/**
+ * Drops all cached responses.
+ *
+ * @param server Server context
+ */
+void server_cache_invalidate(struct server_context_t *server)
+{
+  struct response_cache_t *entry, *tmp;
+  HASH_ITER(hh, server->response_cache, entry, tmp) {
+    HASH_DEL(server->response_cache, entry);
+    free(entry->command);
+    evbuffer_free(entry->response);
+    free(entry);
+  }
+}
+
+/**
+ * Looks up a fresh cached response for the given command.
+ *
+ * @param server Server context
+ * @param cls Command class
+ * @param command Command string
+ * @param size Length of command string
+ * @return Cache entry or NULL if there is no fresh response
+ */
+struct response_cache_t *server_cache_lookup(struct server_context_t *server,
+                                             struct command_class_t *cls,
+                                             const char *command,
+                                             size_t size)
+{
+  struct response_cache_t *entry;
+  HASH_FIND(hh, server->response_cache, command, size, entry);
+  if (!entry || timer_now() - entry->timestamp > cls->cache_ttl)
+    return NULL;
+
+  return entry;
+}
+
+/**
+ * Stores the response to the currently active command into the cache
+ * when its command class permits caching.
+ *
+ * @param server Server context
+ */
+void server_cache_store(struct server_context_t *server)
+{
+  struct command_queue_t *cmd = server->active_command;
+  if (!server_command_is_cacheable(cmd))
+    return;
+
+  // Response may already be stale if a command with side effects is pending
+  if (server->pending_writes > 0 || server->framer.error)
+    return;
+
+  struct response_cache_t *entry;
+  HASH_FIND(hh, server->response_cache, cmd->command, cmd->cmd_length, entry);
+  if (!entry) {
+    entry = (struct response_cache_t*) malloc(sizeof(struct response_cache_t));
+    if (!entry)
+      return;
+
+    entry->command = strndup(cmd->command, cmd->cmd_length);
+    entry->cmd_length = cmd->cmd_length;
+    entry->response = evbuffer_new();
+    if (!entry->command || !entry->response) {
+      free(entry->command);
+      if (entry->response)
+        evbuffer_free(entry->response);
+      free(entry);
+      return;
+    }
+
+    HASH_ADD_KEYPTR(hh, server->response_cache, entry->command, entry->cmd_length, entry);
+  }
+
+  // Take over the collected response body without copying it
+  evbuffer_drain(entry->response, evbuffer_get_length(entry->response));
+  server_frame_extract(&server->framer, server->response, entry->response);
+  entry->timestamp = timer_now();
+}
+
+/**
+ * Queues a new command for transmission to the device or sends it
+ * immediately when the device is idle. Commands with side effects
+ * invalidate the response cache.
+ *
+ * @param server Server context
+ * @param cmd Command context
+ */
+void server_command_submit(struct server_context_t *server, struct command_queue_t *cmd)
+{
+  if (!server_command_is_read_only(cmd)) {
+    server->pending_writes++;
+    server_cache_invalidate(server);
+  }
+
+  if (server->active_command != NULL || server->reset_pid > 0 || server_event_in_progress(server)) {
+    // Queue command, an unsolicited message must not be interleaved with the response
+    // and commands of the server itself are parked while the device is being reset
+    DL_APPEND(server->cmd_queue[cmd->priority], cmd);
+
+    // Do not wait indefinitely for the rest of an unsolicited message
+    if (server->active_command == NULL && server->reset_pid <= 0)
+      server_serial_start_response_timer(server, server->response_timeout);
+
+    DEBUG_LOG("DEBUG: Command queued with %s priority.\n", command_priority_names[cmd->priority]);
+  } else {
+    // Write command immediately
+    server_serial_dispatch_command(server, cmd);
+  }
+}
+
+/**
+ * Answers a command with an error response stating that the device is
+ * being reset.
+ *
+ * @param connection Connection context
+ * @return True on success, false if something went wrong
+ */
+bool server_reply_resetting(struct connection_context_t *connection)
+{
+  struct evbuffer *output = server_connection_reply_output(connection);
+  if (!output)
+    return false;
+
+  struct evbuffer *body = evbuffer_new();
+  if (!body)
+    return false;
+
+  evbuffer_add_printf(body, "error: device reset in progress\r\n");
+  server_frame_write(connection, output, NULL, true, body);
+  evbuffer_free(body);
+  return true;
+}
+
+/**
+ * Sends a command to the serial device. If another command is
+ * currently being processed, the command is queued for later
+ * transmission. Read-only commands are answered from the response
+ * cache when possible, otherwise identical pending commands share
+ * the response of a single device transaction. Commands with side
+ * effects invalidate the response cache.
+ *
+ * @param connection Connection context
+ * @param command Command to send
+ * @param size Length of command string
+ * @param deadline Time after which the response is not needed (msec, 0 if none)
+ * @return True on success, false if something went wrong
+ */
+bool server_send_command(struct connection_context_t *connection,
+                         const char *command,
+                         size_t size,
+                         utimer_t deadline)
+{
+  struct server_context_t *server = connection->server;
+  struct command_class_t *cls = server_find_command_class(server, command, size);
+  struct command_queue_t *cmd = NULL;
+
+  // Priority declared by the client takes precedence over class priority
+  enum command_priority_t priority = COMMAND_PRIORITY_NORMAL;
+  if (connection->priority >= 0)
+    priority = (enum command_priority_t) connection->priority;
+  else if (cls)
+    priority = cls->priority;
+
+  if (cls && cls->read_only && cls->cache_ttl > 0) {
+    struct response_cache_t *entry = server_cache_lookup(server, cls, command, size);
+    if (entry) {
+      struct evbuffer *output = server_connection_reply_output(connection);
+      if (!output) {
+        syslog(LOG_ERR, "Failed to allocate command context, dropping connection.");
+        connection_context_free(connection);
+        return false;
+      }
+
+      server_frame_write(connection, output, NULL, false, entry->response);
+      DEBUG_LOG("DEBUG: Command answered from cache.\n");
+      return true;
+    }
+  }
+
+  // Clients are told that the device is recovering rather than being left
+  // to time out while the reset hook runs
+  if (server->reset_pid > 0) {
+    if (!server_reply_resetting(connection)) {
+      syslog(LOG_ERR, "Failed to allocate command context, dropping connection.");
+      connection_context_free(connection);
+      return false;
+    }
+
+    DEBUG_LOG("DEBUG: Command rejected during device reset.\n");
+    return true;
+  }
+
+  if (cls && cls->read_only) {
+    cmd = server_find_pending_command(server, command, size, priority);
+    if (cmd) {
+      struct command_waiter_t *waiter = server_command_add_waiter(cmd, connection);
+      if (!waiter) {
+        syslog(LOG_ERR, "Failed to allocate command context, dropping connection.");
+        connection_context_free(connection);
+        return false;
+      }
+
+      waiter->deadline = deadline;
+
+      DEBUG_LOG("DEBUG: Command coalesced with a pending command.\n");
+      return true;
+    }
+  }
+
+  cmd = server_command_new(command, size, cls, priority);
+  struct command_waiter_t *waiter = cmd ? server_command_add_waiter(cmd, connection) : NULL;
+  if (!waiter) {
+    syslog(LOG_ERR, "Failed to allocate command context, dropping connection.");
+    server_command_free(cmd);
+    connection_context_free(connection);
+    return false;
+  }
+
+  waiter->deadline = deadline;
+
+  server_command_submit(server, cmd);
+  return true;
+}
+
+/**
+ * Looks up a topic by name.
+ *
+ * @param server Server context
+ * @param name Topic name
+ * @param length Length of topic name
+ * @return Topic or NULL if there is no such topic
+ */
+struct topic_t *server_find_topic(struct server_context_t *server, const char *name, size_t length)
+{
+  struct topic_t *topic;
+  for (topic = server->topics; topic != NULL; topic = topic->next) {
+    if (strlen(topic->name) == length && strncmp(name, topic->name, length) == 0)
+      return topic;
+  }
+
+  return NULL;
+}
+
+/**
+ * Removes a subscription from its topic and connection. Publishing
+ * stops when the last subscriber goes away.
+ *
+ * @param subscription Subscription to free
+ */
+void server_subscription_free(struct subscription_t *subscription)
+{
+  struct topic_t *topic = subscription->topic;
+  DL_DELETE(topic->subscribers, subscription);
+  DL_DELETE2(subscription->connection->subscriptions, subscription, conn_prev, conn_next);
+  free(subscription);
+
+  if (topic->subscribers == NULL)
+    evtimer_del(topic->timer);
+}
+
+/**
+ * Timer callback that publishes the topic to all subscribers. The
+ * response is taken from the cache or shared with an identical pending
+ * command when possible, so all subscribers and polling clients share
+ * a single device transaction. Each response is preceded by a line
+ * naming the topic.
+ *
+ * @param fd Unused
+ * @param events Event mask
+ * @param ctx Topic
+ */
+void server_topic_publish_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct topic_t *topic = (struct topic_t*) ctx;
+  struct server_context_t *server = topic->server;
+  struct command_class_t *cls = server_find_command_class(server, topic->command, topic->cmd_length);
+  enum command_priority_t priority = cls ? cls->priority : COMMAND_PRIORITY_NORMAL;
+  struct subscription_t *subscription;
+
+  // Skip publication while the previous one is still in progress
+  if (topic->subscribers == NULL || topic->pending != NULL)
+    return;
+
+  if (cls && cls->read_only && cls->cache_ttl > 0) {
+    struct response_cache_t *entry = server_cache_lookup(server, cls, topic->command, topic->cmd_length);
+    if (entry) {
+      DL_FOREACH(topic->subscribers, subscription) {
+        struct evbuffer *output = server_connection_reply_output(subscription->connection);
+        if (!output) {
+          syslog(LOG_ERR, "Failed to allocate command context, skipping publication.");
+          continue;
+        }
+
+        server_frame_write(subscription->connection, output, topic->name, false, entry->response);
+      }
+
+      DEBUG_LOG("DEBUG: Topic '%s' published from cache.\n", topic->name);
+      return;
+    }
+  }
+
+  struct command_queue_t *cmd = NULL;
+  bool coalesced = false;
+  if (cls && cls->read_only) {
+    cmd = server_find_pending_command(server, topic->command, topic->cmd_length, priority);
+    coalesced = cmd && cmd->topic == NULL;
+  }
+
+  if (!coalesced) {
+    cmd = server_command_new(topic->command, topic->cmd_length, cls, priority);
+    if (!cmd) {
+      syslog(LOG_ERR, "Failed to allocate command context, skipping publication.");
+      return;
+    }
+  }
+
+  DL_FOREACH(topic->subscribers, subscription) {
+    struct command_waiter_t *waiter = server_command_add_waiter(cmd, subscription->connection);
+    if (!waiter) {
+      syslog(LOG_ERR, "Failed to allocate command context, skipping publication.");
+      continue;
+    }
+
+    if (subscription->connection->binary)
+      waiter->topic = topic->name;
+    else
+      evbuffer_add_printf(server_waiter_output(waiter), "#PUSH %s\r\n", topic->name);
+  }
+
+  if (!coalesced && cmd->waiters == NULL) {
+    server_command_free(cmd);
+    return;
+  }
+
+  cmd->topic = topic;
+  topic->pending = cmd;
+
+  if (!coalesced)
+    server_command_submit(server, cmd);
+}
+
+/**
+ * Parses a priority name.
+ *
+ * @param name Priority name
+ * @param length Length of priority name
+ * @return Priority or -1 if the name is not valid
+ */
+int server_parse_priority(const char *name, size_t length)
+{
+  int i;
+  for (i = 0; i < COMMAND_PRIORITY_COUNT; i++) {
+    if (strlen(command_priority_names[i]) == length && strncmp(name, command_priority_names[i], length) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+/**
+ * Handles the PRIORITY verb, which sets the priority of all further
+ * commands posted by the connection.
+ *
+ * @param connection Connection context
+ * @param args Verb arguments
+ * @param size Length of verb arguments
+ * @param output Buffer for the response
+ * @return True on success, false if the arguments are not valid
+ */
+bool server_verb_priority(struct connection_context_t *connection,
+                          const char *args,
+                          size_t size,
+                          struct evbuffer *output)
+{
+  int priority = server_parse_priority(args, size);
+  if (priority < 0)
+    return false;
+
+  connection->priority = priority;
+  server_frame_write(connection, output, NULL, false, NULL);
+  return true;
+}
+
+/**
+ * Handles the SUBSCRIBE verb, which subscribes the connection to
+ * periodic publications of a topic or to unsolicited device messages.
+ *
+ * @param connection Connection context
+ * @param args Verb arguments
+ * @param size Length of verb arguments
+ * @param output Buffer for the response
+ * @return True on success, false if there is no such topic
+ */
+bool server_verb_subscribe(struct connection_context_t *connection,
+                           const char *args,
+                           size_t size,
+                           struct evbuffer *output)
+{
+  if (size == strlen(EVENT_TOPIC) && strncmp(args, EVENT_TOPIC, size) == 0)
+    return server_event_subscribe(connection, output);
+
+  struct topic_t *topic = server_find_topic(connection->server, args, size);
+  if (!topic)
+    return false;
+
+  struct subscription_t *subscription;
+  DL_FOREACH2(connection->subscriptions, subscription, conn_next) {
+    if (subscription->topic == topic) {
+      server_frame_write(connection, output, NULL, false, NULL);
+      return true;
+    }
+  }
+
+  subscription = (struct subscription_t*) malloc(sizeof(struct subscription_t));
+  if (!subscription)
+    return false;
+
+  subscription->connection = connection;
+  subscription->topic = topic;
+
+  // Start publishing when the first subscriber arrives
+  if (topic->subscribers == NULL)
+    evtimer_add(topic->timer, &topic->interval);
+
+  DL_APPEND(topic->subscribers, subscription);
+  DL_APPEND2(connection->subscriptions, subscription, conn_prev, conn_next);
+  server_frame_write(connection, output, NULL, false, NULL);
+  return true;
+}
+
+/**
+ * Handles the UNSUBSCRIBE verb, which cancels a topic subscription.
+ *
+ * @param connection Connection context
+ * @param args Verb arguments
+ * @param size Length of verb arguments
+ * @param output Buffer for the response
+ * @return True on success, false if there is no such topic
+ */
+bool server_verb_unsubscribe(struct connection_context_t *connection,
+                             const char *args,
+                             size_t size,
+                             struct evbuffer *output)
+{
+  struct server_context_t *server = connection->server;
+  if (size == strlen(EVENT_TOPIC) && strncmp(args, EVENT_TOPIC, size) == 0) {
+    if (connection->event_listener) {
+      DL_DELETE2(server->event_listeners, connection, event_prev, event_next);
+      connection->event_listener = false;
+    }
+
+    server_frame_write(connection, output, NULL, false, NULL);
+    return true;
+  }
+
+  struct topic_t *topic = server_find_topic(server, args, size);
+  if (!topic)
+    return false;
+
+  struct subscription_t *subscription, *tmp;
+  DL_FOREACH_SAFE2(connection->subscriptions, subscription, tmp, conn_next) {
+    if (subscription->topic == topic)
+      server_subscription_free(subscription);
+  }
+
+  server_frame_write(connection, output, NULL, false, NULL);
+  return true;
+}
+
+struct server_metric_t {
+  /// Name in STATS output
+  const char *name;
+  /// Prometheus metric name
+  const char *prometheus_name;
+  /// Prometheus metric description
+  const char *help;
+  /// Offset of the histogram in command metrics
+  size_t offset;
+  /// Factor that converts recorded values to Prometheus units
+  double scale;
+};
+
+/// Histograms exposed for each command verb
+struct server_metric_t server_metrics[] = {
+  { "queue_wait_us", "koruza_command_queue_wait_seconds", "Time commands spent queued.",
+    offsetof(struct command_metrics_t, queue_wait), 1e-6 },
+  { "transmit_us", "koruza_command_transmit_seconds", "Time to transmit commands to the device.",
+    offsetof(struct command_metrics_t, transmit), 1e-6 },
+  { "first_byte_us", "koruza_command_first_byte_seconds", "Time from transmission to the first response byte.",
+    offsetof(struct command_metrics_t, first_byte), 1e-6 },
+  { "response_us", "koruza_command_response_seconds", "Time from transmission to the end of response.",
+    offsetof(struct command_metrics_t, response), 1e-6 },
+  { "response_bytes", "koruza_command_response_bytes", "Response sizes.",
+    offsetof(struct command_metrics_t, response_bytes), 1 },
+  { NULL, NULL, NULL, 0, 0 },
+};
+
+/// Percentiles exposed for each histogram
+double server_metric_percentiles[] = { 50, 90, 99 };
+
+/**
+ * Returns the histogram of a metric.
+ *
+ * @param metrics Command metrics
+ * @param metric Metric descriptor
+ * @return Histogram
+ */
+struct histogram_t *server_metric_histogram(struct command_metrics_t *metrics, struct server_metric_t *metric)
+{
+  return (struct histogram_t*) ((char*) metrics + metric->offset);
+}
+
+/**
+ * Writes metrics of one command verb as "<key>: <value>" lines.
+ *
+ * @param output Output buffer
+ * @param name Command verb
+ * @param metrics Command metrics
+ */
+void server_metrics_write_text(struct evbuffer *output, const char *name, struct command_metrics_t *metrics)
+{
+  struct server_metric_t *metric;
+  evbuffer_add_printf(output, "%s.timeouts: %llu\r\n", name, (unsigned long long) metrics->timeouts);
+  for (metric = server_metrics; metric->name != NULL; metric++) {
+    struct histogram_t *histogram = server_metric_histogram(metrics, metric);
+    evbuffer_add_printf(output, "%s.%s: count %llu mean %llu p50 %llu p90 %llu p99 %llu max %llu\r\n",
+      name, metric->name,
+      (unsigned long long) histogram->count,
+      (unsigned long long) (histogram->count ? histogram->sum / histogram->count : 0),
+      (unsigned long long) histogram_percentile(histogram, 50),
+      (unsigned long long) histogram_percentile(histogram, 90),
+      (unsigned long long) histogram_percentile(histogram, 99),
+      (unsigned long long) histogram->max);
+  }
+}
+
+/**
+ * Writes a command verb as a Prometheus label value. Verbs are sent by
+ * clients, so quotes and backslashes must be escaped.
+ *
+ * @param output Output buffer
+ * @param verb Command verb
+ */
+void server_metrics_write_label(struct evbuffer *output, const char *verb)
+{
+  const char *c;
+  for (c = verb; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      evbuffer_add(output, "\\", 1);
+    evbuffer_add(output, c, 1);
+  }
+}
+
+/**
+ * Writes metrics of all command verbs in Prometheus text format. Verbs
+ * that are not tracked are reported under the "other" label.
+ *
+ * @param server Server context
+ * @param output Output buffer
+ */
+void server_metrics_write_prometheus(struct server_context_t *server, struct evbuffer *output)
+{
+  struct server_metric_t *metric;
+  struct verb_stats_t *entry;
+  size_t i;
+
+  for (metric = server_metrics; metric->name != NULL; metric++) {
+    evbuffer_add_printf(output, "# HELP %s %s\n# TYPE %s summary\n",
+      metric->prometheus_name, metric->help, metric->prometheus_name);
+
+    for (entry = server->verb_stats; ; entry = entry->hh.next) {
+      const char *name = entry ? entry->verb : "other";
+      struct histogram_t *histogram = server_metric_histogram(entry ? &entry->metrics : &server->metrics, metric);
+
+      for (i = 0; i < sizeof(server_metric_percentiles) / sizeof(double); i++) {
+        evbuffer_add_printf(output, "%s{verb=\"", metric->prometheus_name);
+        server_metrics_write_label(output, name);
+        evbuffer_add_printf(output, "\",quantile=\"%g\"} %g\n", server_metric_percentiles[i] / 100,
+          histogram_percentile(histogram, server_metric_percentiles[i]) * metric->scale);
+      }
+      evbuffer_add_printf(output, "%s_sum{verb=\"", metric->prometheus_name);
+      server_metrics_write_label(output, name);
+      evbuffer_add_printf(output, "\"} %g\n", histogram->sum * metric->scale);
+      evbuffer_add_printf(output, "%s_count{verb=\"", metric->prometheus_name);
+      server_metrics_write_label(output, name);
+      evbuffer_add_printf(output, "\"} %llu\n", (unsigned long long) histogram->count);
+
+      if (!entry)
+        break;
+    }
+  }
+
+  evbuffer_add_printf(output, "# HELP koruza_command_timeouts_total Commands that timed out.\n"
+    "# TYPE koruza_command_timeouts_total counter\n");
+  for (entry = server->verb_stats; ; entry = entry->hh.next) {
+    evbuffer_add_printf(output, "koruza_command_timeouts_total{verb=\"");
+    server_metrics_write_label(output, entry ? entry->verb : "other");
+    evbuffer_add_printf(output, "\"} %llu\n",
+      (unsigned long long) (entry ? entry->metrics.timeouts : server->metrics.timeouts));
+
+    if (!entry)
+      break;
+  }
+}
+
+/**
+ * Handles the STATS verb, which returns instrumentation of each command
+ * verb, with verbs beyond the tracked ones reported as "other". With the
+ * "reset" argument, all instrumentation is cleared after it has been
+ * returned.
+ *
+ * @param connection Connection context
+ * @param args Verb arguments
+ * @param size Length of verb arguments
+ * @param output Buffer for the response
+ * @return True on success, false if the arguments are not valid
+ */
+bool server_verb_stats(struct connection_context_t *connection,
+                       const char *args,
+                       size_t size,
+                       struct evbuffer *output)
+{
+  struct server_context_t *server = connection->server;
+  bool reset = size == 5 && strncmp(args, "reset", 5) == 0;
+  if (size > 0 && !reset)
+    return false;
+
+  struct evbuffer *body = evbuffer_new();
+  if (!body)
+    return false;
+
+  struct verb_stats_t *entry;
+  for (entry = server->verb_stats; entry != NULL; entry = entry->hh.next) {
+    server_metrics_write_text(body, entry->verb, &entry->metrics);
+    if (reset)
+      server_metrics_reset(&entry->metrics);
+  }
+  server_metrics_write_text(body, "other", &server->metrics);
+  if (reset)
+    server_metrics_reset(&server->metrics);
+
+  server_frame_write(connection, output, NULL, false, body);
+  evbuffer_free(body);
+  return true;
+}
+
+/**
+ * Handles the PROTOCOL verb, which switches the connection to "text" or
+ * "binary" framing. The response is still framed in the previous mode.
+ * Framing may only change while no responses are outstanding. Without
+ * arguments, the current framing and the verbs handled by the server
+ * are returned, so that clients can check what the server supports.
+ *
+ * @param connection Connection context
+ * @param args Verb arguments
+ * @param size Length of verb arguments
+ * @param output Buffer for the response
+ * @return True on success, false if the arguments are not valid
+ */
+bool server_verb_protocol(struct connection_context_t *connection,
+                          const char *args,
+                          size_t size,
+                          struct evbuffer *output)
+{
+  if (size == 0) {
+    struct evbuffer *body = evbuffer_new();
+    if (!body)
+      return false;
+
+    evbuffer_add_printf(body, "framing: %s\r\n", connection->binary ? "binary" : "text");
+    server_verb_list(body);
+    server_frame_write(connection, output, NULL, false, body);
+    evbuffer_free(body);
+    return true;
+  }
+
+  bool binary;
+  if (size == 4 && strncmp(args, "text", 4) == 0)
+    binary = false;
+  else if (size == 6 && strncmp(args, "binary", 6) == 0)
+    binary = true;
+  else
+    return false;
+
+  if (connection->waiters != NULL)
+    return false;
+
+  server_frame_write(connection, output, NULL, false, NULL);
+  connection->binary = binary;
+  return true;
+}
+
+/**
+ * Handles the DEADLINE verb, which sets the number of milliseconds after
+ * which the response to the next command posted by the connection is no
+ * longer needed. If the command is still queued by then, it is answered
+ * with an error instead of being sent to the device.
+ *
+ * @param connection Connection context
+ * @param args Verb arguments
+ * @param size Length of verb arguments
+ * @param output Buffer for the response
+ * @return True on success, false if the arguments are not valid
+ */
+bool server_verb_deadline(struct connection_context_t *connection,
+                          const char *args,
+                          size_t size,
+                          struct evbuffer *output)
+{
+  utimer_t timeout = 0;
+  size_t i;
+  for (i = 0; i < size; i++) {
+    if (args[i] < '0' || args[i] > '9')
+      return false;
+    timeout = timeout * 10 + (args[i] - '0');
+    if (timeout > DEADLINE_MAX)
+      return false;
+  }
+
+  if (timeout == 0)
+    return false;
+
+  connection->deadline = timer_now() + timeout;
+  server_frame_write(connection, output, NULL, false, NULL);
+  return true;
+}
+
+struct server_verb_t {
+  /// Verb name
+  const char *name;
+  /// Verb handler, writes the response on success
+  bool (*handler)(struct connection_context_t *connection, const char *args, size_t size, struct evbuffer *output);
+};
+
+/// Verbs handled by the server itself instead of the device
+struct server_verb_t server_verbs[] = {
+  { "PRIORITY", server_verb_priority },
+  { "SUBSCRIBE", server_verb_subscribe },
+  { "UNSUBSCRIBE", server_verb_unsubscribe },
+  { "STATS", server_verb_stats },
+  { "PROTOCOL", server_verb_protocol },
+  { "DEADLINE", server_verb_deadline },
+  { NULL, NULL },
+};
+
+/**
+ * Writes the names of all verbs handled by the server as a
+ * "verbs: <name> ..." line.
+ *
+ * @param output Output buffer
+ */
+void server_verb_list(struct evbuffer *output)
+{
+  struct server_verb_t *verb;
+  evbuffer_add_printf(output, "verbs:");
+  for (verb = server_verbs; verb->name != NULL; verb++)
+    evbuffer_add_printf(output, " %s", verb->name);
+  evbuffer_add_printf(output, "\r\n");
+}
+
+/**
+ * Processes a command received from a connection. Verbs are handled
+ * by the server, everything else is sent to the device.
+ *
+ * @param connection Connection context
+ * @param command Command string
+ * @param size Length of command string
+ * @return True on success, false if the connection has been dropped
+ */
+bool server_process_command(struct connection_context_t *connection, const char *command, size_t size)
+{
+  // Deadline only applies to the command following the DEADLINE verb
+  utimer_t deadline = connection->deadline;
+  connection->deadline = 0;
+
+  // Strip line terminator from arguments
+  size_t length = size;
+  while (length > 0 && (command[length - 1] == '\n' || command[length - 1] == '\r'))
+    length--;
+
+  struct server_verb_t *verb;
+  for (verb = server_verbs; verb->name != NULL; verb++) {
+    size_t name_length = strlen(verb->name);
+    if (length < name_length || strncmp(command, verb->name, name_length) != 0)
+      continue;
+    if (length > name_length && command[name_length] != ' ')
+      continue;
+
+    const char *args = command + name_length;
+    size_t args_length = length - name_length;
+    while (args_length > 0 && *args == ' ') {
+      args++;
+      args_length--;
+    }
+
+    struct evbuffer *output = server_connection_reply_output(connection);
+    if (!output) {
+      syslog(LOG_ERR, "Failed to allocate command context, dropping connection.");
+      connection_context_free(connection);
+      return false;
+    }
+
+    if (!verb->handler(connection, args, args_length, output))
+      server_frame_write(connection, output, NULL, true, NULL);
+    return true;
+  }
+
+  return server_send_command(connection, command, size, deadline);
+}
+
+/**
+ * Processes the next request received from a connection that uses
+ * binary framing. The request is processed directly from the input
+ * buffer, as its length is known in advance.
+ *
+ * @param connection Connection context
+ * @param input Buffer with received data
+ * @return True when a request has been processed, false when more data
+ *   is needed or the connection has been dropped
+ */
+bool server_connection_read_frame(struct connection_context_t *connection, struct evbuffer *input)
+{
+  uint8_t buffer[PROTOCOL_HEADER_SIZE];
+  if (evbuffer_copyout(input, buffer, sizeof(buffer)) < (ssize_t) sizeof(buffer))
+    return false;
+
+  struct protocol_header_t header;
+  protocol_header_decode(&header, buffer);
+  if (header.length == 0 || header.length > PROTOCOL_MAX_REQUEST || header.topic_length > 0) {
+    syslog(LOG_ERR, "Protocol error, invalid request frame.");
+
+    // Close the connection
+    connection_context_free(connection);
+    return false;
+  } else if (evbuffer_get_length(input) < sizeof(buffer) + header.length) {
+    // Wait for the rest of the request
+    return false;
+  }
+
+  evbuffer_drain(input, sizeof(buffer));
+  connection->request_id = header.id;
+  if (!server_process_command(connection, (const char*) evbuffer_pullup(input, header.length), header.length))
+    return false;
+
+  connection->request_id = 0;
+  evbuffer_drain(input, header.length);
+  return true;
+}
+
+/**
+ * Callback for connection read events.
+ *
+ * @param bev Buffer event
+ * @param ctx Connection context
+ */
+void server_connection_read_cb(struct bufferevent *bev, void *ctx)
+{
+  struct connection_context_t *connection = (struct connection_context_t*) ctx;
+  struct evbuffer *input = bufferevent_get_input(bev);
+
+  // Clients may send multiple commands at once, each one is processed in order
+  for (;;) {
+    if (connection->binary) {
+      if (!server_connection_read_frame(connection, input))
+        return;
+      continue;
+    }
+
+    struct evbuffer_ptr eol = evbuffer_search(input, "\n", 1, NULL);
+    size_t length = eol.pos < 0 ? evbuffer_get_length(input) : eol.pos + 1;
+    if (length >= sizeof(connection->command)) {
+      syslog(LOG_ERR, "Protocol error, command too long.");
+
+      // Close the connection
+      connection_context_free(connection);
+      return;
+    } else if (eol.pos < 0) {
+      // Wait for the rest of the command
+      return;
+    }
+
+    evbuffer_remove(input, connection->command, length);
+    connection->command[length] = 0;
+    connection->cmd_length = length;
+
+    DEBUG_LOG("DEBUG: Got command: %s", connection->command);
+
+    // Command has been parsed, send (or queue)
+    if (!server_process_command(connection, connection->command, connection->cmd_length))
+      return;
+  }
+}
+
+/**
+ * Callback for connection exceptional events.
+ *
+ * @param bev Buffer event
+ * @param events Event mask
+ * @param ctx Connection context
+ */
+void server_connection_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+  struct connection_context_t *connection = (struct connection_context_t*) ctx;
+
+  if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+    syslog(LOG_INFO, "Connection closed.");
+    connection_context_free(connection);
+  }
+}
+
+/**
+ * Callback for accepting new connections.
+ *
+ * @param listener Connection listener
+ * @param fd Accepted connection file descriptor
+ * @param address Remote address
+ * @param ctx Server context
+ */
+void server_accept_conn_cb(struct evconnlistener *listener,
+                           evutil_socket_t fd,
+                           struct sockaddr *address,
+                           int socklen,
+                           void *ctx)
+{
+  struct server_context_t *server = (struct server_context_t*) ctx;
+
+  struct connection_context_t *connection = connection_context_new(server);
+  if (!connection) {
+    syslog(LOG_ERR, "Failed to allocate connection context, dropping connection.");
+    // TODO close connection?
+    return;
+  }
+
+  struct event_base *base = evconnlistener_get_base(listener);
+  connection->conn_bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+  bufferevent_setcb(connection->conn_bev, server_connection_read_cb, NULL, server_connection_event_cb, connection);
+  bufferevent_enable(connection->conn_bev, EV_READ | EV_WRITE);
+
+  syslog(LOG_INFO, "Accepted new connection.");
+}
+
+/**
+ * Callback for metrics connection write events, closing the connection
+ * once the metrics have been sent.
+ *
+ * @param bev Buffer event
+ * @param ctx Unused
+ */
+void server_metrics_write_cb(struct bufferevent *bev, void *ctx)
+{
+  bufferevent_free(bev);
+}
+
+/**
+ * Callback for metrics connection exceptional events.
+ *
+ * @param bev Buffer event
+ * @param events Event mask
+ * @param ctx Unused
+ */
+void server_metrics_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+  if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF))
+    bufferevent_free(bev);
+}
+
+/**
+ * Callback for metrics connection read events. Metrics are sent as a
+ * plain HTTP response in Prometheus text format once the request has
+ * been received, then the connection is closed.
+ *
+ * @param bev Buffer event
+ * @param ctx Server context
+ */
+void server_metrics_read_cb(struct bufferevent *bev, void *ctx)
+{
+  struct server_context_t *server = (struct server_context_t*) ctx;
+  struct evbuffer *input = bufferevent_get_input(bev);
+
+  // Wait for the end of request headers
+  struct evbuffer_ptr end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+  if (end.pos < 0 && evbuffer_get_length(input) < 8192)
+    return;
+
+  bufferevent_disable(bev, EV_READ);
+  evbuffer_drain(input, evbuffer_get_length(input));
+
+  struct evbuffer *body = evbuffer_new();
+  if (!body) {
+    syslog(LOG_ERR, "Failed to allocate metrics response.");
+    bufferevent_free(bev);
+    return;
+  }
+
+  server_metrics_write_prometheus(server, body);
+
+  struct evbuffer *output = bufferevent_get_output(bev);
+  evbuffer_add_printf(output, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+    "Content-Length: %zu\r\n\r\n", evbuffer_get_length(body));
+  evbuffer_add_buffer(output, body);
+  evbuffer_free(body);
+
+  // Close the connection once the response has been written
+  bufferevent_setcb(bev, NULL, server_metrics_write_cb, server_metrics_event_cb, NULL);
+  bufferevent_enable(bev, EV_WRITE);
+}
+
+/**
+ * Callback for accepting metrics scrapes.
+ *
+ * @param listener Connection listener
+ * @param fd Accepted connection file descriptor
+ * @param address Remote address
+ * @param ctx Server context
+ */
+void server_metrics_accept_cb(struct evconnlistener *listener,
+                              evutil_socket_t fd,
+                              struct sockaddr *address,
+                              int socklen,
+                              void *ctx)
+{
+  struct bufferevent *bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev) {
+    syslog(LOG_ERR, "Failed to allocate metrics connection.");
+    close(fd);
+    return;
+  }
+
+  bufferevent_setcb(bev, server_metrics_read_cb, NULL, server_metrics_event_cb, ctx);
+  bufferevent_enable(bev, EV_READ);
+}
+
+/**
+ * Removes the next command to be sent to the device from the command
+ * queues according to the configured scheduling policy.
+ *
+ * @param server Server context
+ * @return Next command or NULL if all queues are empty
+ */
+struct command_queue_t *server_schedule_command(struct server_context_t *server)
+{
+  int priority = -1;
+  int i;
+
+  for (i = 0; i < COMMAND_PRIORITY_COUNT; i++) {
+    if (server->cmd_queue[i] == NULL)
+      continue;
+
+    if (server->scheduler_policy == SCHEDULER_POLICY_STRICT || server->scheduler_credits[i] > 0) {
+      priority = i;
+      break;
+    }
+
+    if (priority < 0)
+      priority = i;
+  }
+
+  if (priority < 0)
+    return NULL;
+
+  if (server->scheduler_policy == SCHEDULER_POLICY_WEIGHTED) {
+    if (server->scheduler_credits[priority] <= 0) {
+      // All waiting priorities have used up their share, start a new round
+      for (i = 0; i < COMMAND_PRIORITY_COUNT; i++)
+        server->scheduler_credits[i] = server->scheduler_weights[i];
+    }
+
+    server->scheduler_credits[priority]--;
+  }
+
+  struct command_queue_t *cmd = server->cmd_queue[priority];
+  DL_DELETE(server->cmd_queue[priority], cmd);
+  return cmd;
+}
+
+/**
+ * Initializes latency statistics.
+ *
+ * @param stats Latency statistics
+ * @param timeout Response timeout to use until enough latencies are known
+ */
+void server_latency_init(struct latency_stats_t *stats, utimer_t timeout)
+{
+  stats->count = 0;
+  stats->next = 0;
+  stats->timeout = timeout;
+}
+
+/**
+ * Compares two latencies for sorting.
+ */
+int server_latency_compare(const void *a, const void *b)
+{
+  utimer_t x = *(const utimer_t*) a;
+  utimer_t y = *(const utimer_t*) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Records a response latency and derives the response timeout from the
+ * 99th percentile of recent latencies plus a safety margin.
+ *
+ * @param stats Latency statistics
+ * @param latency Response latency (msec)
+ */
+void server_latency_record(struct latency_stats_t *stats, utimer_t latency)
+{
+  stats->samples[stats->next] = latency;
+  stats->next = (stats->next + 1) % LATENCY_SAMPLES;
+  if (stats->count < LATENCY_SAMPLES)
+    stats->count++;
+
+  if (stats->count < LATENCY_MIN_SAMPLES)
+    return;
+
+  utimer_t sorted[LATENCY_SAMPLES];
+  memcpy(sorted, stats->samples, stats->count * sizeof(utimer_t));
+  qsort(sorted, stats->count, sizeof(utimer_t), server_latency_compare);
+
+  utimer_t percentile = sorted[(stats->count - 1) * 99 / 100];
+  utimer_t timeout = percentile + percentile / 2 + 100;
+  if (timeout < TIMEOUT_MIN)
+    timeout = TIMEOUT_MIN;
+  else if (timeout > TIMEOUT_MAX)
+    timeout = TIMEOUT_MAX;
+
+  stats->timeout = timeout;
+}
+
+/**
+ * Returns the length of the command verb, which is the command name
+ * followed by its numeric code if there is one (e.g. "A 7" for
+ * "A 7 100 200"), as latencies of different codes differ widely.
+ *
+ * @param command Command
+ * @param size Length of command
+ * @return Length of command verb
+ */
+size_t server_command_verb_length(const char *command, size_t size)
+{
+  size_t length = 0;
+  while (length < size && !isspace(command[length]))
+    length++;
+
+  size_t start = length;
+  while (start < size && command[start] == ' ')
+    start++;
+
+  size_t end = start;
+  while (end < size && isdigit(command[end]))
+    end++;
+
+  if (end > start && (end == size || isspace(command[end])))
+    length = end;
+
+  return length;
+}
+
+/**
+ * Returns statistics for the command verb, creating them when the verb
+ * is seen for the first time.
+ *
+ * @param server Server context
+ * @param cmd Command context
+ * @return Verb statistics or NULL if the verb is not tracked
+ */
+struct verb_stats_t *server_command_verb(struct server_context_t *server, struct command_queue_t *cmd)
+{
+  size_t length = server_command_verb_length(cmd->command, cmd->cmd_length);
+  struct verb_stats_t *entry;
+  HASH_FIND(hh, server->verb_stats, cmd->command, length, entry);
+  if (entry)
+    return entry;
+
+  // Do not let clients grow the table without bounds
+  if (length == 0 || HASH_COUNT(server->verb_stats) >= LATENCY_MAX_VERBS)
+    return NULL;
+
+  entry = (struct verb_stats_t*) malloc(sizeof(struct verb_stats_t));
+  if (!entry)
+    return NULL;
+
+  entry->verb = strndup(cmd->command, length);
+  if (!entry->verb) {
+    free(entry);
+    return NULL;
+  }
+
+  server_latency_init(&entry->latency, server->response_timeout);
+  server_metrics_reset(&entry->metrics);
+  HASH_ADD_KEYPTR(hh, server->verb_stats, entry->verb, length, entry);
+  return entry;
+}
+
+/**
+ * Returns latency statistics for the command verb.
+ *
+ * @param server Server context
+ * @param cmd Command context
+ * @return Latency statistics or NULL if the verb is not tracked
+ */
+struct latency_stats_t *server_command_latency(struct server_context_t *server, struct command_queue_t *cmd)
+{
+  struct verb_stats_t *entry = server_command_verb(server, cmd);
+  return entry ? &entry->latency : NULL;
+}
+
+/**
+ * Returns the response timeout for the command. A timeout configured
+ * for the command class takes precedence over the one adapted to
+ * latencies of the command verb.
+ *
+ * @param server Server context
+ * @param cmd Command context
+ * @return Response timeout (msec)
+ */
+utimer_t server_command_timeout(struct server_context_t *server, struct command_queue_t *cmd)
+{
+  if (cmd->cls && cmd->cls->timeout > 0)
+    return cmd->cls->timeout;
+
+  struct latency_stats_t *stats = server_command_latency(server, cmd);
+  return stats ? stats->timeout : server->response_timeout;
+}
+
+/**
+ * Returns instrumentation for the command.
+ *
+ * @param server Server context
+ * @param cmd Command context
+ * @return Metrics of the command verb
+ */
+struct command_metrics_t *server_command_metrics(struct server_context_t *server, struct command_queue_t *cmd)
+{
+  struct verb_stats_t *entry = server_command_verb(server, cmd);
+  return entry ? &entry->metrics : &server->metrics;
+}
+
+/**
+ * Records instrumentation for the active command when its response
+ * is complete.
+ *
+ * @param server Server context
+ */
+void server_metrics_record(struct server_context_t *server)
+{
+  struct command_queue_t *cmd = server->active_command;
+  struct command_metrics_t *metrics = server_command_metrics(server, cmd);
+  utimer_t now = timer_now_usec();
+
+  if (cmd->transmitted_usec)
+    histogram_record(&metrics->transmit, cmd->transmitted_usec - cmd->sent_usec);
+  if (cmd->first_byte_usec)
+    histogram_record(&metrics->first_byte, cmd->first_byte_usec - cmd->sent_usec);
+  histogram_record(&metrics->response, now - cmd->sent_usec);
+  histogram_record(&metrics->response_bytes, server->rsp_length);
+}
+
+/**
+ * Clears instrumentation.
+ *
+ * @param metrics Metrics to clear
+ */
+void server_metrics_reset(struct command_metrics_t *metrics)
+{
+  metrics->timeouts = 0;
+  histogram_reset(&metrics->queue_wait);
+  histogram_reset(&metrics->transmit);
+  histogram_reset(&metrics->first_byte);
+  histogram_reset(&metrics->response);
+  histogram_reset(&metrics->response_bytes);
+}
+
+/**
+ * Makes the command active, records how long it has been queued and
+ * sends it to the device.
+ *
+ * @param server Server context
+ * @param cmd Command context
+ */
+void server_serial_dispatch_command(struct server_context_t *server, struct command_queue_t *cmd)
+{
+  struct queue_stats_t *stats = &server->queue_stats[cmd->priority];
+  server->active_command = cmd;
+  cmd->sent_usec = timer_now_usec();
+
+  utimer_t wait = (cmd->sent_usec - cmd->queued_usec) / 1000;
+  stats->count++;
+  stats->wait_total += wait;
+  if (wait > stats->wait_max)
+    stats->wait_max = wait;
+
+  histogram_record(&server_command_metrics(server, cmd)->queue_wait, cmd->sent_usec - cmd->queued_usec);
+  server_serial_send_command(server, cmd->command, cmd->cmd_length, server_command_timeout(server, cmd));
+}
+
+/**
+ * Logs queue wait statistics for each priority.
+ *
+ * @param fd Signal number
+ * @param events Event mask
+ * @param ctx Server context
+ */
+void server_queue_stats_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct server_context_t *server = (struct server_context_t*) ctx;
+  int i;
+
+  for (i = 0; i < COMMAND_PRIORITY_COUNT; i++) {
+    struct queue_stats_t *stats = &server->queue_stats[i];
+    syslog(LOG_INFO, "Queue wait for %s priority: %zu commands, avg %llu ms, max %llu ms.",
+      command_priority_names[i],
+      stats->count,
+      stats->count ? stats->wait_total / stats->count : 0,
+      stats->wait_max);
+  }
+
+  syslog(LOG_INFO, "Cancelled %zu queued commands of closed connections.", server->cancelled_commands);
+  syslog(LOG_INFO, "Dropped %zu queued commands with expired deadlines.", server->expired_commands);
+
+  struct command_class_t *cls;
+  for (cls = server->command_classes; cls != NULL; cls = cls->next) {
+    if (cls->timeout > 0)
+      syslog(LOG_INFO, "Response timeout for '%s' commands: %llu ms (fixed).", cls->name, cls->timeout);
+  }
+
+  struct verb_stats_t *entry;
+  for (entry = server->verb_stats; entry != NULL; entry = entry->hh.next) {
+    syslog(LOG_INFO, "Response timeout for '%s' commands: %llu ms (%zu samples).", entry->verb,
+      entry->latency.timeout, entry->latency.count);
+  }
+  syslog(LOG_INFO, "Response timeout for other commands: %llu ms.", server->response_timeout);
+  syslog(LOG_INFO, "Device reset hook ran %zu times, avg %llu ms, max %llu ms.",
+    server->reset_stats.count,
+    server->reset_stats.count ? server->reset_stats.wait_total / server->reset_stats.count : 0,
+    server->reset_stats.wait_max);
+  if (server->reset_pid > 0)
+    syslog(LOG_INFO, "Device reset hook running for %llu ms.", timer_now() - server->reset_timestamp);
+}
+
+/**
+ * Dequeues the next command and sends it to the device.
+ *
+ * @param server Server context
+ */
+void server_serial_dispatch_next(struct server_context_t *server)
+{
+  struct command_queue_t *cmd;
+  while ((cmd = server_schedule_command(server)) != NULL) {
+    if (!server_command_expire(server, cmd)) {
+      server_serial_dispatch_command(server, cmd);
+      return;
+    }
+  }
+}
+
+/**
+ * Returns true while an unsolicited message is being received, which is
+ * once its frame header has been seen.
+ *
+ * @param server Server context
+ * @return True if the device is in the middle of an unsolicited message
+ */
+bool server_event_in_progress(struct server_context_t *server)
+{
+  return server->event_framer.header;
+}
+
+/**
+ * Subscribes the connection to unsolicited device messages. Messages
+ * still held in the ring buffer are replayed immediately.
+ *
+ * @param connection Connection context
+ * @param output Buffer for the response
+ * @return True on success
+ */
+bool server_event_subscribe(struct connection_context_t *connection, struct evbuffer *output)
+{
+  struct server_context_t *server = connection->server;
+  server_frame_write(connection, output, NULL, false, NULL);
+  if (connection->event_listener)
+    return true;
+
+  connection->event_listener = true;
+  DL_APPEND2(server->event_listeners, connection, event_prev, event_next);
+
+  size_t i;
+  for (i = 0; i < server->event_ring_count; i++) {
+    server_frame_write(connection, output, EVENT_TOPIC, false,
+      server->event_ring[(server->event_ring_start + i) % server->event_ring_size]);
+  }
+
+  return true;
+}
+
+/**
+ * Stores the received unsolicited message into the ring buffer, replacing
+ * the oldest message when it is full, and sends it to all subscribed
+ * connections.
+ *
+ * @param server Server context
+ */
+void server_event_publish(struct server_context_t *server)
+{
+  struct evbuffer *message = server->frame_body;
+  server_frame_extract(&server->event_framer, server->event_frame, message);
+
+  if (server->event_ring_size > 0) {
+    size_t index;
+    if (server->event_ring_count < server->event_ring_size) {
+      index = (server->event_ring_start + server->event_ring_count) % server->event_ring_size;
+      if (!server->event_ring[index])
+        server->event_ring[index] = evbuffer_new();
+      if (server->event_ring[index])
+        server->event_ring_count++;
+    } else {
+      index = server->event_ring_start;
+      server->event_ring_start = (server->event_ring_start + 1) % server->event_ring_size;
+      evbuffer_drain(server->event_ring[index], evbuffer_get_length(server->event_ring[index]));
+    }
+
+    if (server->event_ring[index]) {
+      evbuffer_add_buffer(server->event_ring[index], server->frame_body);
+      message = server->event_ring[index];
+    }
+  }
+
+  struct connection_context_t *connection;
+  DL_FOREACH2(server->event_listeners, connection, event_next) {
+    struct evbuffer *output = server_connection_reply_output(connection);
+    if (!output) {
+      syslog(LOG_ERR, "Failed to allocate command context, skipping unsolicited message.");
+      continue;
+    }
+
+    server_frame_write(connection, output, EVENT_TOPIC, false, message);
+  }
+
+  evbuffer_drain(server->frame_body, evbuffer_get_length(server->frame_body));
+}
+
+/**
+ * Discards the unsolicited message being received.
+ *
+ * @param server Server context
+ */
+void server_event_discard(struct server_context_t *server)
+{
+  evbuffer_drain(server->event_frame, evbuffer_get_length(server->event_frame));
+  framer_init(&server->event_framer);
+}
+
+/**
+ * Receives serial data while no command is active. Complete frames are
+ * published to subscribed connections, lines outside of a frame are
+ * dropped.
+ *
+ * @param server Server context
+ * @param input Buffer with received data
+ * @return False when more data is needed to continue
+ */
+bool server_event_receive(struct server_context_t *server, struct evbuffer *input)
+{
+  while (!server->event_framer.header) {
+    struct evbuffer_ptr eol = evbuffer_search(input, "\n", 1, NULL);
+    if (eol.pos < 0) {
+      // Only the start of a frame header is worth waiting for, other
+      // partial lines are noise
+      size_t length = evbuffer_get_length(input);
+      struct framer_t probe = server->event_framer;
+      enum framer_event_t event;
+      framer_feed_buffer(&probe, (const char*) evbuffer_pullup(input, length), length, &event);
+      if (!framer_in_header(&probe)) {
+        syslog(LOG_WARNING, "Partial line received but not requested, dropping.");
+        evbuffer_drain(input, length);
+      }
+
+      // Wait for the rest of the line
+      return false;
+    }
+
+    size_t length = eol.pos + 1;
+    enum framer_event_t event;
+    framer_feed_buffer(&server->event_framer, (const char*) evbuffer_pullup(input, length), length, &event);
+    if (server->event_framer.header) {
+      evbuffer_remove_buffer(input, server->event_frame, length);
+      break;
+    }
+
+    syslog(LOG_WARNING, "Message received but not requested!");
+    evbuffer_drain(input, length);
+
+    // Frame positions are relative to the start of the header line
+    framer_init(&server->event_framer);
+    if (evbuffer_get_length(input) == 0)
+      return false;
+  }
+
+  bool done = false;
+  size_t length = server_response_scan(&server->event_framer, input, &done);
+  evbuffer_remove_buffer(input, server->event_frame, length);
+
+  if (done) {
+    DEBUG_LOG("DEBUG: Received unsolicited message from device.\n");
+    server_event_publish(server);
+    server_event_discard(server);
+  } else if (evbuffer_get_length(server->event_frame) > EVENT_MAX_SIZE) {
+    syslog(LOG_WARNING, "Unsolicited message too long, dropping.");
+    server_event_discard(server);
+  }
+
+  // Commands held back while the message was received are sent by the caller
+  if (!server->event_framer.header && server->timeout_event)
+    evtimer_del(server->timeout_event);
+
+  return true;
+}
+
+/**
+ * Completes the active command.
+ *
+ * @param server Server context
+ * @param dispatch True if the next queued command should be sent
+ */
+void server_serial_command_done(struct server_context_t *server, bool dispatch)
+{
+  // Cancel response timeout timer
+  if (server->timeout_event)
+    evtimer_del(server->timeout_event);
+
+  if (server->active_command && !server_command_is_read_only(server->active_command)) {
+    // Device state may have changed, so cached responses are no longer valid
+    server->pending_writes--;
+    server_cache_invalidate(server);
+  }
+
+  if (server->active_command)
+    server_command_complete(server->active_command, &server->framer);
+
+  server_command_free(server->active_command);
+  server->active_command = NULL;
+
+  server->rsp_length = 0;
+  evbuffer_drain(server->response, evbuffer_get_length(server->response));
+  framer_init(&server->framer);
+
+  if (dispatch)
+    server_serial_dispatch_next(server);
+}
+
+/**
+ * Reopens the serial port after a reset.
+ *
+ * @param server Server context
+ * @param fail_active True if the active command has been failed and
+ *   the next one should be processed
+ * @return True on success, false if the port could not be reopened
+ */
+bool server_serial_reopen(struct server_context_t *server, bool fail_active)
+{
+  int serial_fd = open(server->serial_device, O_RDWR);
+  if (serial_fd == -1) {
+    syslog(LOG_ERR, "Failed to reopen serial device '%s'!", server->serial_device);
+    server_serial_start_reopen_timer(server, 5000);
+    return false;
+  }
+
+  if (fcntl(serial_fd, F_SETFL, O_NONBLOCK) < 0) {
+    syslog(LOG_ERR, "Failed to reconfigure serial port.");
+    close(serial_fd);
+    server_serial_start_reopen_timer(server, 2000);
+    return false;
+  }
 
-  if (server->cmd_queue_start != NULL) {
-    // Dequeue next message and send it to device
-    struct command_queue_t *cmd = server->cmd_queue_start;
-    server->active_connection = cmd->connection;
-    server->cmd_queue_start = cmd->next;
-    if (server->cmd_queue_start == NULL)
-      server->cmd_queue_tail = NULL;
+  if (tcsetattr(serial_fd, TCSAFLUSH, &server->serial_tio) < 0) {
+    syslog(LOG_ERR, "Failed to reconfigure serial port!");
+    server_serial_start_reopen_timer(server, 2000);
+    return false;
+  }
 
-    server_serial_send_command(server, cmd->command, cmd->cmd_length);
-    free(cmd->command);
-    free(cmd);
-  } else {
-    server->active_connection = NULL;
+  // Listen for serial port I/O
+  server->serial_bev = bufferevent_socket_new(server->base, serial_fd, BEV_OPT_CLOSE_ON_FREE);
+  bufferevent_setcb(server->serial_bev, server_serial_read_cb, server_serial_write_cb, server_serial_event_cb, server);
+  bufferevent_enable(server->serial_bev, EV_READ | EV_WRITE);
+
+  // Process next command in queue (if any)
+  if (fail_active) {
+    server_serial_command_done(server, true);
   }
+
+  return true;
 }
 
 /**
- * Performs a serial port reset, aborting any pending commands.
+ * Performs a serial port reset, aborting any pending commands. When a
+ * device reset hook is configured, it runs in the background and the
+ * port is reopened once it exits. Commands are parked in the meantime.
  *
  * @param server Server context
+ * @param fail_active True if the active command should be failed
+ * @return True if the port has been reopened, false if reopening
+ *   failed or is deferred until the reset hook completes
  */
 bool server_serial_reset(struct server_context_t *server, bool fail_active)
 {
   // Fail the currently active command
-  if (fail_active && server->active_connection) {
-    bufferevent_write(server->active_connection->conn_bev, "#ERROR\r\n#STOP\r\n", 15);
+  if (fail_active && server->active_command) {
+    server_command_fail(server->active_command);
   }
 
+  // Partially received unsolicited message will not be completed
+  server_event_discard(server);
+
   // Close serial port
   if (server->serial_bev) {
     bufferevent_free(server->serial_bev);
     server->serial_bev = NULL;
   }
 
+  // Port is reopened when the running hook completes
+  if (server->reset_pid > 0)
+    return false;
+
   // Call external script to perform device reset
   if (server->hook_device_reset != NULL) {
-    pid_t pid = fork();
-    if (pid == 0) {
-      execl(server->hook_device_reset, server->hook_device_reset, (char*) NULL);
-      exit(1);
-    } else {
-      int status;
-      waitpid(pid, &status, 0);
+    char *argv[] = { (char*) server->hook_device_reset, NULL };
+    pid_t pid;
+    int error = posix_spawn(&pid, server->hook_device_reset, NULL, NULL, argv, environ);
+    if (error == 0) {
+      DEBUG_LOG("DEBUG: Started device reset hook (pid %d).\n", pid);
+      server->reset_pid = pid;
+      server->reset_timestamp = timer_now();
+
+      // Hook completion takes over from the response timeout
+      if (server->timeout_event)
+        evtimer_del(server->timeout_event);
+      if (server->reopen_event)
+        evtimer_del(server->reopen_event);
+      return false;
     }
-  }
 
-  int serial_fd = open(server->serial_device, O_RDWR);
-  if (serial_fd == -1) {
-    syslog(LOG_ERR, "Failed to reopen serial device '%s'!", server->serial_device);
-    server_serial_start_response_timer(server, 5);
-    return false;
+    syslog(LOG_ERR, "Failed to start device reset hook: %s", strerror(error));
   }
 
-  if (fcntl(serial_fd, F_SETFL, O_NONBLOCK) < 0) {
-    syslog(LOG_ERR, "Failed to reconfigure serial port.");
-    close(serial_fd);
-    server_serial_start_response_timer(server, 2);
-    return false;
-  }
+  return server_serial_reopen(server, fail_active);
+}
 
-  if (tcsetattr(serial_fd, TCSAFLUSH, &server->serial_tio) < 0) {
-    syslog(LOG_ERR, "Failed to reconfigure serial port!");
-    server_serial_start_response_timer(server, 2);
-    return false;
-  }
+/**
+ * Callback for SIGCHLD that completes a device reset when the reset
+ * hook exits.
+ *
+ * @param fd Signal number
+ * @param events Event mask
+ * @param ctx Server context
+ */
+void server_reset_hook_done_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct server_context_t *server = (struct server_context_t*) ctx;
+  int status;
 
-  // Listen for serial port I/O
-  server->serial_bev = bufferevent_socket_new(server->base, serial_fd, BEV_OPT_CLOSE_ON_FREE);
-  bufferevent_setcb(server->serial_bev, server_serial_read_cb, NULL, server_serial_event_cb, server);
-  bufferevent_enable(server->serial_bev, EV_READ | EV_WRITE);
+  if (server->reset_pid <= 0 || waitpid(server->reset_pid, &status, WNOHANG) != server->reset_pid)
+    return;
 
-  // Process next command in queue (if any)
-  if (fail_active) {
-    server_serial_command_done(server);
-  }
+  utimer_t duration = timer_now() - server->reset_timestamp;
+  server->reset_pid = -1;
+  server->reset_stats.count++;
+  server->reset_stats.wait_total += duration;
+  if (duration > server->reset_stats.wait_max)
+    server->reset_stats.wait_max = duration;
 
-  return true;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    syslog(LOG_INFO, "Device reset hook completed in %llu ms.", duration);
+  else
+    syslog(LOG_WARNING, "Device reset hook failed after %llu ms (status %d).", duration, status);
+
+  // Failed active command is completed after the port is reopened
+  server_serial_reopen(server, true);
 }
 
 /**
@@ -351,7 +2781,19 @@ bool server_serial_reset(struct server_context_t *server, bool fail_active)
 void server_serial_read_response_timeout_cb(evutil_socket_t fd, short events, void *ctx)
 {
   struct server_context_t *server = (struct server_context_t*) ctx;
-  syslog(LOG_ERR, "Read from serial port timed out, resetting port.");
+  struct command_queue_t *cmd = server->active_command;
+  if (cmd && cmd->sent_usec) {
+    // Response may just be slower than before, so back off for the next one
+    struct latency_stats_t *stats = server_command_latency(server, cmd);
+    server_command_metrics(server, cmd)->timeouts++;
+    if (stats)
+      stats->timeout = stats->timeout * 2 < TIMEOUT_MAX ? stats->timeout * 2 : TIMEOUT_MAX;
+    syslog(LOG_ERR, "Read from serial port timed out after %llu ms, resetting port.",
+      (timer_now_usec() - cmd->sent_usec) / 1000);
+  } else {
+    syslog(LOG_ERR, "Read from serial port timed out, resetting port.");
+  }
+
   server_serial_reset(server, true);
 }
 
@@ -359,39 +2801,126 @@ void server_serial_read_response_timeout_cb(evutil_socket_t fd, short events, vo
  * Starts the response timeout timer.
  *
  * @param server Server context
- * @param timeout Requested timeout in seconds
+ * @param timeout Requested timeout in milliseconds
  */
-void server_serial_start_response_timer(struct server_context_t *server, int timeout)
+void server_serial_start_response_timer(struct server_context_t *server, utimer_t timeout)
 {
-  struct timeval one_sec = { timeout, 0 };
+  struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
   if (!server->timeout_event)
     server->timeout_event = evtimer_new(server->base, server_serial_read_response_timeout_cb, server);
-  evtimer_add(server->timeout_event, &one_sec);
+  evtimer_add(server->timeout_event, &tv);
   DEBUG_LOG("DEBUG: Scheduled serial read timeout event.\n");
 }
 
+/**
+ * Serial port reopen retry callback.
+ *
+ * @param fd Unused
+ * @param events Event mask
+ * @param ctx Server context
+ */
+void server_serial_reopen_timeout_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct server_context_t *server = (struct server_context_t*) ctx;
+  syslog(LOG_INFO, "Retrying serial port reset.");
+  server_serial_reset(server, true);
+}
+
+/**
+ * Starts the timer that retries a failed serial port reset. It replaces
+ * the response timeout, as the failed command must not be counted as
+ * timed out again.
+ *
+ * @param server Server context
+ * @param timeout Retry delay in milliseconds
+ */
+void server_serial_start_reopen_timer(struct server_context_t *server, utimer_t timeout)
+{
+  struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+  if (server->timeout_event)
+    evtimer_del(server->timeout_event);
+  if (!server->reopen_event)
+    server->reopen_event = evtimer_new(server->base, server_serial_reopen_timeout_cb, server);
+  evtimer_add(server->reopen_event, &tv);
+}
+
 /**
  * Sends a command to the underlying serial device.
  *
  * @param server Server context
  * @param command Command to send
  * @param length Command length
+ * @param timeout Response timeout (msec)
  */
-void server_serial_send_command(struct server_context_t *server, const char *command, size_t length)
+void server_serial_send_command(struct server_context_t *server, const char *command, size_t length, utimer_t timeout)
 {
-  server_serial_start_response_timer(server, 1);
+  server_serial_start_response_timer(server, timeout);
 
   if (!server->serial_bev && !server_serial_reset(server, false)) {
     syslog(LOG_ERR, "Failed to reset serial port before command, returning error!");
 
-    if (server->active_connection)
-      bufferevent_write(server->active_connection->conn_bev, "#ERROR\r\n#STOP\r\n", 15);
+    if (server->active_command)
+      server_command_fail(server->active_command);
   } else {
+    // Data received before the command is sent cannot be its response
+    struct evbuffer *input = bufferevent_get_input(server->serial_bev);
+    if (evbuffer_get_length(input) > 0) {
+      syslog(LOG_WARNING, "Dropping %zu bytes received but not requested.", evbuffer_get_length(input));
+      evbuffer_drain(input, evbuffer_get_length(input));
+    }
+
     bufferevent_write(server->serial_bev, command, length);
     DEBUG_LOG("DEBUG: Next command sent to device: %s", command);
   }
 }
 
+/**
+ * Feeds received serial data into a framer without copying it out of
+ * the buffer.
+ *
+ * @param framer Framing state
+ * @param input Buffer with received data
+ * @param done Output flag set when the end of message has been found
+ * @return Number of bytes that belong to the current message
+ */
+size_t server_response_scan(struct framer_t *framer, struct evbuffer *input, bool *done)
+{
+  struct evbuffer_iovec vec[SCAN_IOVECS];
+  struct evbuffer_ptr position;
+  size_t total = evbuffer_get_length(input);
+  size_t length = 0;
+
+  while (length < total) {
+    if (evbuffer_ptr_set(input, &position, length, EVBUFFER_PTR_SET) < 0)
+      break;
+
+    int n = evbuffer_peek(input, total - length, &position, vec, SCAN_IOVECS);
+    if (n <= 0)
+      break;
+    if (n > SCAN_IOVECS)
+      n = SCAN_IOVECS;
+
+    int i;
+    for (i = 0; i < n && length < total; i++) {
+      size_t size = vec[i].iov_len < total - length ? vec[i].iov_len : total - length;
+      size_t offset = 0;
+      while (offset < size) {
+        enum framer_event_t event;
+        offset += framer_feed_buffer(framer, (const char*) vec[i].iov_base + offset, size - offset, &event);
+
+        if (event == FRAMER_EVENT_STOP) {
+          *done = true;
+          return length + offset;
+        }
+      }
+
+      length += size;
+    }
+  }
+
+  return length;
+}
+
 /**
  * Callback for serial port read events.
  *
@@ -402,39 +2931,60 @@ void server_serial_read_cb(struct bufferevent *bev, void *ctx)
 {
   struct server_context_t *server = (struct server_context_t*) ctx;
 
-  if (server->active_connection == NULL) {
-    // Ignore messages that were not requested
-    syslog(LOG_WARNING, "Message received but not requested!");
-
-    struct evbuffer *buf = evbuffer_new();
-    bufferevent_read_buffer(bev, buf);
-    evbuffer_free(buf);
-    return;
-  }
-
-  char buffer[128];
-  for (;;) {
-    int n = bufferevent_read(bev, buffer, sizeof(buffer));
-    if (n <= 0)
-      break;
-
-    DEBUG_LOG("DEBUG: Received: %.*s\n", n, buffer);
+  struct evbuffer *input = bufferevent_get_input(bev);
 
-    size_t offset = server->rsp_length;
-    server->rsp_length += n;
-    server->response = realloc(server->response, server->rsp_length + 1);
-    memcpy(server->response + offset, buffer, n);
-    server->response[server->rsp_length] = 0;
+  while (evbuffer_get_length(input) > 0) {
+    if (server->active_command == NULL) {
+      // Messages that were not requested are passed on to subscribed connections
+      if (!server_event_receive(server, input))
+        break;
+      continue;
+    }
 
-    // Simply pipe the output to the currently active connection
-    bufferevent_write(server->active_connection->conn_bev, buffer, n);
+    // Find the end of message in received data
+    bool done = false;
+    size_t length = server_response_scan(&server->framer, input, &done);
+    if (server->rsp_length == 0)
+      server->active_command->first_byte_usec = timer_now_usec();
+    server->rsp_length += length;
+
+    DEBUG_LOG("DEBUG: Received %zu bytes.\n", length);
+
+    // Simply pipe the output to all connections waiting for the active command
+    server_command_forward(server, input, length);
+
+    if (done) {
+      DEBUG_LOG("DEBUG: Received end of message from device.\n");
+      struct command_queue_t *cmd = server->active_command;
+      struct latency_stats_t *stats = server_command_latency(server, cmd);
+      if (stats)
+        server_latency_record(stats, (timer_now_usec() - cmd->sent_usec) / 1000);
+      server_metrics_record(server);
+      server_snapshot_store(server);
+      server_cache_store(server);
+
+      // Data following the response is framed before the next command is
+      // sent, so that it is not taken for its response
+      server_serial_command_done(server, false);
+    }
   }
 
-  // Detect the end of message
-  if (strncmp(server->response + server->rsp_length - 9, "\r\n#STOP\r\n", 9) == 0) {
-    DEBUG_LOG("DEBUG: Received end of message from device.\n");
-    server_serial_command_done(server);
-  }
+  if (server->active_command == NULL && !server_event_in_progress(server))
+    server_serial_dispatch_next(server);
+}
+
+/**
+ * Callback for serial port write events, invoked when all buffered
+ * data has been written to the device.
+ *
+ * @param bev Buffer event
+ * @param ctx Server context
+ */
+void server_serial_write_cb(struct bufferevent *bev, void *ctx)
+{
+  struct server_context_t *server = (struct server_context_t*) ctx;
+  if (server->active_command && !server->active_command->transmitted_usec)
+    server->active_command->transmitted_usec = timer_now_usec();
 }
 
 /**
@@ -454,6 +3004,246 @@ void server_serial_event_cb(struct bufferevent *bev, short events, void *ctx)
   }
 }
 
+/**
+ * Parses command class configuration.
+ *
+ * @param server Server context
+ * @param config Command classes configuration object
+ * @return True on success, false if something went wrong
+ */
+bool server_parse_command_classes(struct server_context_t *server, const ucl_object_t *config)
+{
+  ucl_object_iter_t it = NULL;
+  const ucl_object_t *cfg_cls;
+  while ((cfg_cls = ucl_iterate_object(config, &it, true)) != NULL) {
+    struct command_class_t *cls = (struct command_class_t*) malloc(sizeof(struct command_class_t));
+    if (!cls) {
+      fprintf(stderr, "ERROR: Failed to allocate command class!\n");
+      return false;
+    }
+
+    cls->name = ucl_object_key(cfg_cls);
+    cls->prefix = NULL;
+    cls->read_only = false;
+    cls->cache_ttl = 0;
+    cls->priority = COMMAND_PRIORITY_NORMAL;
+    cls->timeout = 0;
+    cls->next = server->command_classes;
+    server->command_classes = cls;
+
+    const ucl_object_t *obj = ucl_object_find_key(cfg_cls, "prefix");
+    if (!obj) {
+      fprintf(stderr, "ERROR: Missing 'prefix' for command class '%s'!\n", cls->name);
+      return false;
+    } else if (!ucl_object_tostring_safe(obj, &cls->prefix)) {
+      fprintf(stderr, "ERROR: Prefix for command class '%s' must be a string!\n", cls->name);
+      return false;
+    }
+    cls->prefix_length = strlen(cls->prefix);
+
+    obj = ucl_object_find_key(cfg_cls, "read_only");
+    if (obj && !ucl_object_toboolean_safe(obj, &cls->read_only)) {
+      fprintf(stderr, "ERROR: Option 'read_only' for command class '%s' must be a boolean!\n", cls->name);
+      return false;
+    }
+
+    double cache_ttl_sec;
+    obj = ucl_object_find_key(cfg_cls, "cache_ttl");
+    if (obj) {
+      if (!ucl_object_todouble_safe(obj, &cache_ttl_sec)) {
+        fprintf(stderr, "ERROR: Option 'cache_ttl' for command class '%s' must be an integer or double!\n", cls->name);
+        return false;
+      } else if (!cls->read_only) {
+        fprintf(stderr, "ERROR: Only read-only command class '%s' may set 'cache_ttl'!\n", cls->name);
+        return false;
+      }
+
+      cls->cache_ttl = (utimer_t) (cache_ttl_sec * 1000);
+    }
+
+    const char *priority_name;
+    obj = ucl_object_find_key(cfg_cls, "priority");
+    if (obj) {
+      int priority = -1;
+      if (ucl_object_tostring_safe(obj, &priority_name))
+        priority = server_parse_priority(priority_name, strlen(priority_name));
+
+      if (priority < 0) {
+        fprintf(stderr, "ERROR: Priority for command class '%s' must be one of 'high', 'normal' or 'low'!\n", cls->name);
+        return false;
+      }
+
+      cls->priority = (enum command_priority_t) priority;
+    }
+
+    double timeout_sec;
+    obj = ucl_object_find_key(cfg_cls, "timeout");
+    if (obj) {
+      if (!ucl_object_todouble_safe(obj, &timeout_sec) || timeout_sec <= 0) {
+        fprintf(stderr, "ERROR: Timeout for command class '%s' must be a positive integer or double!\n", cls->name);
+        return false;
+      }
+
+      cls->timeout = (utimer_t) (timeout_sec * 1000);
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Parses command scheduler configuration.
+ *
+ * @param server Server context
+ * @param config Scheduler configuration object
+ * @return True on success, false if something went wrong
+ */
+bool server_parse_scheduler(struct server_context_t *server, const ucl_object_t *config)
+{
+  const char *policy;
+  const ucl_object_t *obj = ucl_object_find_key(config, "policy");
+  if (obj) {
+    if (!ucl_object_tostring_safe(obj, &policy)) {
+      fprintf(stderr, "ERROR: Scheduler policy must be a string!\n");
+      return false;
+    } else if (strcmp(policy, "strict") == 0) {
+      server->scheduler_policy = SCHEDULER_POLICY_STRICT;
+    } else if (strcmp(policy, "weighted") == 0) {
+      server->scheduler_policy = SCHEDULER_POLICY_WEIGHTED;
+    } else {
+      fprintf(stderr, "ERROR: Scheduler policy must be either 'strict' or 'weighted'!\n");
+      return false;
+    }
+  }
+
+  const ucl_object_t *weights = ucl_object_find_key(config, "weights");
+  if (weights) {
+    int i;
+    for (i = 0; i < COMMAND_PRIORITY_COUNT; i++) {
+      obj = ucl_object_find_key(weights, command_priority_names[i]);
+      if (!obj)
+        continue;
+
+      if (!ucl_object_toint_safe(obj, &server->scheduler_weights[i]) || server->scheduler_weights[i] < 1) {
+        fprintf(stderr, "ERROR: Scheduler weight for '%s' priority must be a positive integer!\n",
+          command_priority_names[i]);
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Parses shared memory status snapshot configuration and creates the
+ * snapshot region.
+ *
+ * @param server Server context
+ * @param config Snapshot configuration object
+ * @return True on success, false if something went wrong
+ */
+bool server_parse_snapshot(struct server_context_t *server, const ucl_object_t *config)
+{
+  const char *path;
+  const ucl_object_t *obj = ucl_object_find_key(config, "path");
+  if (!obj) {
+    fprintf(stderr, "ERROR: Missing 'path' for status snapshot!\n");
+    return false;
+  } else if (!ucl_object_tostring_safe(obj, &path)) {
+    fprintf(stderr, "ERROR: Status snapshot path must be a string!\n");
+    return false;
+  }
+
+  obj = ucl_object_find_key(config, "command");
+  if (!obj) {
+    fprintf(stderr, "ERROR: Missing 'command' for status snapshot!\n");
+    return false;
+  } else if (!ucl_object_tostring_safe(obj, &server->snapshot_command)) {
+    fprintf(stderr, "ERROR: Status snapshot command must be a string!\n");
+    return false;
+  }
+  server->snapshot_cmd_length = strlen(server->snapshot_command);
+
+  double interval_sec = 0;
+  obj = ucl_object_find_key(config, "interval");
+  if (obj && (!ucl_object_todouble_safe(obj, &interval_sec) || interval_sec <= 0)) {
+    fprintf(stderr, "ERROR: Status snapshot interval must be a positive integer or double!\n");
+    return false;
+  }
+
+  server->snapshot_interval.tv_sec = (long) interval_sec;
+  server->snapshot_interval.tv_usec = (long) ((interval_sec - server->snapshot_interval.tv_sec) * 1000000);
+
+  server->snapshot = snapshot_create(path);
+  if (!server->snapshot) {
+    fprintf(stderr, "ERROR: Failed to create status snapshot '%s'!\n", path);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Parses topic configuration.
+ *
+ * @param server Server context
+ * @param config Topics configuration object
+ * @return True on success, false if something went wrong
+ */
+bool server_parse_topics(struct server_context_t *server, const ucl_object_t *config)
+{
+  ucl_object_iter_t it = NULL;
+  const ucl_object_t *cfg_topic;
+  while ((cfg_topic = ucl_iterate_object(config, &it, true)) != NULL) {
+    struct topic_t *topic = (struct topic_t*) malloc(sizeof(struct topic_t));
+    if (!topic) {
+      fprintf(stderr, "ERROR: Failed to allocate topic!\n");
+      return false;
+    }
+
+    topic->name = ucl_object_key(cfg_topic);
+    if (strcmp(topic->name, EVENT_TOPIC) == 0) {
+      fprintf(stderr, "ERROR: Topic name '%s' is reserved for unsolicited device messages!\n", EVENT_TOPIC);
+      free(topic);
+      return false;
+    }
+
+    topic->command = NULL;
+    topic->server = server;
+    topic->timer = NULL;
+    topic->subscribers = NULL;
+    topic->pending = NULL;
+    topic->next = server->topics;
+    server->topics = topic;
+
+    const ucl_object_t *obj = ucl_object_find_key(cfg_topic, "command");
+    if (!obj) {
+      fprintf(stderr, "ERROR: Missing 'command' for topic '%s'!\n", topic->name);
+      return false;
+    } else if (!ucl_object_tostring_safe(obj, &topic->command)) {
+      fprintf(stderr, "ERROR: Command for topic '%s' must be a string!\n", topic->name);
+      return false;
+    }
+    topic->cmd_length = strlen(topic->command);
+
+    double interval_sec;
+    obj = ucl_object_find_key(cfg_topic, "interval");
+    if (!obj) {
+      fprintf(stderr, "ERROR: Missing 'interval' for topic '%s'!\n", topic->name);
+      return false;
+    } else if (!ucl_object_todouble_safe(obj, &interval_sec) || interval_sec <= 0) {
+      fprintf(stderr, "ERROR: Interval for topic '%s' must be a positive integer or double!\n", topic->name);
+      return false;
+    }
+
+    topic->interval.tv_sec = (long) interval_sec;
+    topic->interval.tv_usec = (long) ((interval_sec - topic->interval.tv_sec) * 1000000);
+  }
+
+  return true;
+}
+
 /**
  * Starts the server.
  *
@@ -467,6 +3257,7 @@ bool start_server(ucl_object_t *config, int log_option)
   ucl_object_t *obj = NULL;
   bool ret_value = false;
   int serial_fd = -1;
+  int i;
 
   // Install signal handlers
   signal(SIGHUP, SIG_IGN);
@@ -475,12 +3266,47 @@ bool start_server(ucl_object_t *config, int log_option)
   // Create the server context
   struct server_context_t ctx;
   ctx.timeout_event = NULL;
-  ctx.active_connection = NULL;
-  ctx.cmd_queue_start = NULL;
-  ctx.cmd_queue_tail = NULL;
+  ctx.reopen_event = NULL;
+  ctx.active_command = NULL;
+  ctx.cancelled_commands = 0;
+  ctx.expired_commands = 0;
+  ctx.scheduler_policy = SCHEDULER_POLICY_STRICT;
+  ctx.response_timeout = 1000;
+  server_metrics_reset(&ctx.metrics);
+  ctx.metrics_listener = NULL;
+  for (i = 0; i < COMMAND_PRIORITY_COUNT; i++) {
+    ctx.cmd_queue[i] = NULL;
+    ctx.scheduler_weights[i] = 1 << (2 * (COMMAND_PRIORITY_COUNT - 1 - i));
+    ctx.scheduler_credits[i] = 0;
+    ctx.queue_stats[i].count = 0;
+    ctx.queue_stats[i].wait_total = 0;
+    ctx.queue_stats[i].wait_max = 0;
+  }
   ctx.response = NULL;
+  ctx.rsp_chunk = NULL;
+  ctx.frame_body = NULL;
   ctx.rsp_length = 0;
+  framer_init(&ctx.framer);
   ctx.hook_device_reset = NULL;
+  ctx.reset_pid = -1;
+  ctx.reset_timestamp = 0;
+  ctx.reset_stats.count = 0;
+  ctx.reset_stats.wait_total = 0;
+  ctx.reset_stats.wait_max = 0;
+  ctx.command_classes = NULL;
+  ctx.verb_stats = NULL;
+  ctx.response_cache = NULL;
+  ctx.pending_writes = 0;
+  ctx.topics = NULL;
+  ctx.event_frame = NULL;
+  framer_init(&ctx.event_framer);
+  ctx.event_ring = NULL;
+  ctx.event_ring_size = 16;
+  ctx.event_ring_start = 0;
+  ctx.event_ring_count = 0;
+  ctx.event_listeners = NULL;
+  ctx.snapshot = NULL;
+  ctx.snapshot_timer = NULL;
 
   obj = ucl_object_find_key(config, "device");
   if (!obj) {
@@ -556,7 +3382,7 @@ bool start_server(ucl_object_t *config, int log_option)
 
   // Configure hooks
   const ucl_object_t *hooks = ucl_object_find_key(config, "hooks");
-  if (obj) {
+  if (hooks) {
     // Device reset hook
     obj = ucl_object_find_key(hooks, "reset");
     if (obj && !ucl_object_tostring_safe(obj, &ctx.hook_device_reset)) {
@@ -565,6 +3391,58 @@ bool start_server(ucl_object_t *config, int log_option)
     }
   }
 
+  // Configure initial response timeout, adapted to observed latencies later
+  obj = ucl_object_find_key(config, "response_timeout");
+  if (obj) {
+    double timeout_sec;
+    if (!ucl_object_todouble_safe(obj, &timeout_sec) || timeout_sec <= 0) {
+      fprintf(stderr, "ERROR: Response timeout must be a positive integer or double!\n");
+      goto cleanup_exit;
+    }
+
+    ctx.response_timeout = (utimer_t) (timeout_sec * 1000);
+  }
+
+  // Configure command classes
+  obj = ucl_object_find_key(config, "commands");
+  if (obj && !server_parse_command_classes(&ctx, obj))
+    goto cleanup_exit;
+
+  // Configure command scheduler
+  obj = ucl_object_find_key(config, "scheduler");
+  if (obj && !server_parse_scheduler(&ctx, obj))
+    goto cleanup_exit;
+
+  // Configure the number of unsolicited messages kept for new subscribers
+  obj = ucl_object_find_key(config, "event_history");
+  if (obj) {
+    int64_t event_history;
+    if (!ucl_object_toint_safe(obj, &event_history) || event_history < 0) {
+      fprintf(stderr, "ERROR: Event history must be a non-negative integer!\n");
+      goto cleanup_exit;
+    }
+
+    ctx.event_ring_size = event_history;
+  }
+
+  if (ctx.event_ring_size > 0) {
+    ctx.event_ring = (struct evbuffer**) calloc(ctx.event_ring_size, sizeof(struct evbuffer*));
+    if (!ctx.event_ring) {
+      fprintf(stderr, "ERROR: Failed to allocate event history!\n");
+      goto cleanup_exit;
+    }
+  }
+
+  // Configure shared memory status snapshot
+  const ucl_object_t *snapshot = ucl_object_find_key(config, "snapshot");
+  if (snapshot && !server_parse_snapshot(&ctx, snapshot))
+    goto cleanup_exit;
+
+  // Configure published topics
+  obj = ucl_object_find_key(config, "topics");
+  if (obj && !server_parse_topics(&ctx, obj))
+    goto cleanup_exit;
+
   // Open the syslog facility
   openlog("koruza-control", log_option, LOG_DAEMON);
   syslog(LOG_INFO, "KORUZA control daemon starting up.");
@@ -577,6 +3455,22 @@ bool start_server(ucl_object_t *config, int log_option)
   // Setup the event loop
   struct event_base *base = event_base_new();
   ctx.base = base;
+  ctx.response = evbuffer_new();
+  ctx.rsp_chunk = evbuffer_new();
+  ctx.frame_body = evbuffer_new();
+  ctx.event_frame = evbuffer_new();
+
+  // Setup topic publishing timers, started when a connection subscribes
+  struct topic_t *topic;
+  for (topic = ctx.topics; topic != NULL; topic = topic->next) {
+    topic->timer = event_new(base, -1, EV_PERSIST, server_topic_publish_cb, topic);
+  }
+
+  // Refresh the status snapshot even when no client requests the status
+  if (ctx.snapshot && (ctx.snapshot_interval.tv_sec > 0 || ctx.snapshot_interval.tv_usec > 0)) {
+    ctx.snapshot_timer = event_new(base, -1, EV_PERSIST, server_snapshot_refresh_cb, &ctx);
+    evtimer_add(ctx.snapshot_timer, &ctx.snapshot_interval);
+  }
 
   // Setup the UNIX socket
   struct sockaddr_un address;
@@ -605,20 +3499,100 @@ bool start_server(ucl_object_t *config, int log_option)
     goto cleanup_ev_exit;
   }
 
+  // Setup the optional UNIX socket for metrics scrapes
+  obj = ucl_object_find_key(config, "metrics_socket");
+  if (obj) {
+    const char *metrics_path;
+    if (!ucl_object_tostring_safe(obj, &metrics_path)) {
+      syslog(LOG_ERR, "Metrics socket path must be a string!");
+      goto cleanup_ev_exit;
+    }
+
+    struct sockaddr_un metrics_address;
+    memset(&metrics_address, 0, sizeof(metrics_address));
+    metrics_address.sun_family = AF_UNIX;
+    strncpy(metrics_address.sun_path, metrics_path, sizeof(metrics_address.sun_path) - 1);
+    unlink(metrics_path);
+
+    ctx.metrics_listener = evconnlistener_new_bind(
+      base, server_metrics_accept_cb, &ctx, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+      (struct sockaddr *) &metrics_address, sizeof(metrics_address)
+    );
+    if (!ctx.metrics_listener) {
+      syslog(LOG_ERR, "Could not create metrics socket listener!");
+      goto cleanup_ev_exit;
+    }
+  }
+
   // Listen for serial port I/O
   ctx.serial_bev = bufferevent_socket_new(base, serial_fd, BEV_OPT_CLOSE_ON_FREE);
-  bufferevent_setcb(ctx.serial_bev, server_serial_read_cb, NULL, server_serial_event_cb, &ctx);
+  bufferevent_setcb(ctx.serial_bev, server_serial_read_cb, server_serial_write_cb, server_serial_event_cb, &ctx);
   bufferevent_enable(ctx.serial_bev, EV_READ | EV_WRITE);
 
+  // Log queue statistics on request
+  struct event *stats_event = evsignal_new(base, SIGUSR1, server_queue_stats_cb, &ctx);
+  evsignal_add(stats_event, NULL);
+
+  // Complete device resets when the reset hook exits
+  struct event *child_event = evsignal_new(base, SIGCHLD, server_reset_hook_done_cb, &ctx);
+  evsignal_add(child_event, NULL);
+
   syslog(LOG_INFO, "Entering dispatch loop.");
 
   // Enter the event loop
   event_base_dispatch(base);
 
 cleanup_ev_exit:
+  if (ctx.metrics_listener)
+    evconnlistener_free(ctx.metrics_listener);
+  if (ctx.timeout_event)
+    event_free(ctx.timeout_event);
+  if (ctx.reopen_event)
+    event_free(ctx.reopen_event);
+  if (ctx.snapshot_timer)
+    event_free(ctx.snapshot_timer);
+  for (topic = ctx.topics; topic != NULL; topic = topic->next) {
+    event_free(topic->timer);
+    topic->timer = NULL;
+  }
+  evbuffer_free(ctx.response);
+  evbuffer_free(ctx.rsp_chunk);
+  evbuffer_free(ctx.frame_body);
+  evbuffer_free(ctx.event_frame);
+  for (i = 0; i < ctx.event_ring_size; i++) {
+    if (ctx.event_ring[i])
+      evbuffer_free(ctx.event_ring[i]);
+  }
   event_base_free(base);
 cleanup_exit:
   if (serial_fd != -1)
     close(serial_fd);
+
+  server_cache_invalidate(&ctx);
+
+  while (ctx.command_classes != NULL) {
+    struct command_class_t *cls = ctx.command_classes;
+    ctx.command_classes = cls->next;
+    free(cls);
+  }
+
+  struct verb_stats_t *entry, *tmp;
+  HASH_ITER(hh, ctx.verb_stats, entry, tmp) {
+    HASH_DEL(ctx.verb_stats, entry);
+    free(entry->verb);
+    free(entry);
+  }
+
+  free(ctx.event_ring);
+  snapshot_close(ctx.snapshot);
+
+  while (ctx.topics != NULL) {
+    topic = ctx.topics;
+    ctx.topics = topic->next;
+    if (topic->timer)
+      event_free(topic->timer);
+    free(topic);
+  }
+
   return ret_value;
 }
@@ -0,0 +1,214 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+/**
+ * Creates the snapshot region and maps it into memory for writing.
+ * Any previous snapshot at the same path is cleared.
+ *
+ * @param path Path to the region, usually in /dev/shm
+ * @return Mapped region or NULL if something went wrong
+ */
+struct snapshot_region_t *snapshot_create(const char *path)
+{
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    return NULL;
+
+  if (ftruncate(fd, sizeof(struct snapshot_region_t)) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  struct snapshot_region_t *region = (struct snapshot_region_t*) mmap(NULL, sizeof(struct snapshot_region_t),
+    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED)
+    return NULL;
+
+  memset(region, 0, sizeof(struct snapshot_region_t));
+  region->version = SNAPSHOT_VERSION;
+  __atomic_store_n(&region->magic, SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+  return region;
+}
+
+/**
+ * Copies at most size - 1 characters into a NUL-terminated field.
+ *
+ * @param field Destination field
+ * @param size Size of destination field
+ * @param data Source characters
+ * @param length Number of source characters
+ */
+static void snapshot_copy_field(char *field, size_t size, const char *data, size_t length)
+{
+  if (length >= size)
+    length = size - 1;
+
+  memcpy(field, data, length);
+  field[length] = 0;
+}
+
+/**
+ * Parses a status response and publishes its "<key>: <value>" lines
+ * as the new snapshot. Frame marker lines are ignored. Readers never
+ * block the writer; they retry when an update overlaps their read.
+ *
+ * @param region Mapped region
+ * @param response Response data
+ * @param length Length of response data
+ */
+void snapshot_update(struct snapshot_region_t *region, const char *response, size_t length)
+{
+  struct snapshot_data_t *data = &region->data;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  // Enter write section, readers retry while the sequence is odd
+  __atomic_store_n(&region->sequence, region->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  data->timestamp = (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  data->count = 0;
+
+  const char *end = response + length;
+  while (response < end && data->count < SNAPSHOT_MAX_ENTRIES) {
+    const char *eol = memchr(response, '\n', end - response);
+    const char *line = response;
+    size_t line_length = (eol ? eol : end) - line;
+    response = eol ? eol + 1 : end;
+
+    if (line_length > 0 && line[line_length - 1] == '\r')
+      line_length--;
+    if (line_length == 0 || line[0] == '#')
+      continue;
+
+    const char *separator = memchr(line, ':', line_length);
+    if (!separator)
+      continue;
+
+    const char *value = separator + 1;
+    while (value < line + line_length && *value == ' ')
+      value++;
+
+    struct snapshot_entry_t *entry = &data->entries[data->count++];
+    snapshot_copy_field(entry->key, sizeof(entry->key), line, separator - line);
+    snapshot_copy_field(entry->value, sizeof(entry->value), value, line + line_length - value);
+  }
+
+  // Leave write section
+  __atomic_store_n(&region->sequence, region->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Maps an existing snapshot region into memory for reading.
+ *
+ * @param path Path to the region
+ * @return Mapped region or NULL if something went wrong
+ */
+struct snapshot_region_t *snapshot_open(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "ERROR: Unable to open status snapshot '%s'!\n", path);
+    return NULL;
+  }
+
+  struct snapshot_region_t *region = (struct snapshot_region_t*) mmap(NULL, sizeof(struct snapshot_region_t),
+    PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Unable to map status snapshot '%s'!\n", path);
+    return NULL;
+  }
+
+  if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != SNAPSHOT_MAGIC || region->version != SNAPSHOT_VERSION) {
+    fprintf(stderr, "ERROR: File '%s' is not a compatible status snapshot!\n", path);
+    munmap(region, sizeof(struct snapshot_region_t));
+    return NULL;
+  }
+
+  return region;
+}
+
+/**
+ * Copies a consistent snapshot out of the region without taking any
+ * locks.
+ *
+ * @param region Mapped region
+ * @param data Output snapshot data
+ * @return True on success, false if no status has been published yet
+ */
+bool snapshot_read(const struct snapshot_region_t *region, struct snapshot_data_t *data)
+{
+  uint32_t sequence;
+  for (;;) {
+    sequence = __atomic_load_n(&region->sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1)
+      continue;
+
+    data->timestamp = region->data.timestamp;
+    data->count = region->data.count;
+    if (data->count > SNAPSHOT_MAX_ENTRIES)
+      data->count = SNAPSHOT_MAX_ENTRIES;
+    memcpy(data->entries, region->data.entries, data->count * sizeof(struct snapshot_entry_t));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&region->sequence, __ATOMIC_RELAXED) == sequence)
+      break;
+  }
+
+  return sequence != 0;
+}
+
+/**
+ * Looks up a status value by key.
+ *
+ * @param data Snapshot data
+ * @param key Status key
+ * @return Status value or NULL if there is no such key
+ */
+const char *snapshot_find(const struct snapshot_data_t *data, const char *key)
+{
+  uint32_t i;
+  for (i = 0; i < data->count; i++) {
+    if (strcmp(data->entries[i].key, key) == 0)
+      return data->entries[i].value;
+  }
+
+  return NULL;
+}
+
+/**
+ * Unmaps the snapshot region.
+ *
+ * @param region Mapped region
+ */
+void snapshot_close(struct snapshot_region_t *region)
+{
+  if (region)
+    munmap(region, sizeof(struct snapshot_region_t));
+}
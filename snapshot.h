@@ -0,0 +1,74 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_CONTROLLER_SNAPSHOT_H
+#define KORUZA_CONTROLLER_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Identifies a status snapshot region
+#define SNAPSHOT_MAGIC 0x4b525a53
+/// Snapshot layout version
+#define SNAPSHOT_VERSION 1
+/// Maximum number of status entries
+#define SNAPSHOT_MAX_ENTRIES 64
+/// Size of entry key including the terminating NUL
+#define SNAPSHOT_KEY_SIZE 32
+/// Size of entry value including the terminating NUL
+#define SNAPSHOT_VALUE_SIZE 96
+
+struct snapshot_entry_t {
+  /// Status key
+  char key[SNAPSHOT_KEY_SIZE];
+  /// Status value as received from the device
+  char value[SNAPSHOT_VALUE_SIZE];
+};
+
+struct snapshot_data_t {
+  /// Time when the status was received (msec since epoch)
+  uint64_t timestamp;
+  /// Number of valid entries
+  uint32_t count;
+  /// Status entries in the order received
+  struct snapshot_entry_t entries[SNAPSHOT_MAX_ENTRIES];
+};
+
+struct snapshot_region_t {
+  /// Magic number
+  uint32_t magic;
+  /// Layout version
+  uint32_t version;
+  /// Sequence counter, odd while an update is in progress
+  uint32_t sequence;
+  /// Snapshot data
+  struct snapshot_data_t data;
+};
+
+// Writer API, used by the server
+struct snapshot_region_t *snapshot_create(const char *path);
+void snapshot_update(struct snapshot_region_t *region, const char *response, size_t length);
+
+// Reader API
+struct snapshot_region_t *snapshot_open(const char *path);
+bool snapshot_read(const struct snapshot_region_t *region, struct snapshot_data_t *data);
+const char *snapshot_find(const struct snapshot_data_t *data, const char *key);
+void snapshot_close(struct snapshot_region_t *region);
+
+#endif
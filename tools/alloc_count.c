@@ -0,0 +1,119 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Preloaded into a process to count its heap allocations and the bytes
+ * it copies with memcpy() and memmove(). Only calls that go through the
+ * dynamic linker are seen, which includes all calls made by libevent.
+ *
+ * Counters are written to the file named by ALLOC_COUNT_OUTPUT (or to
+ * stderr) on ALLOC_COUNT_DUMP and cleared on ALLOC_COUNT_RESET.
+ */
+
+/// Signal that writes the counters
+#define ALLOC_COUNT_DUMP (SIGRTMIN + 1)
+/// Signal that clears the counters
+#define ALLOC_COUNT_RESET (SIGRTMIN + 2)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile unsigned long alloc_count;
+static volatile unsigned long alloc_bytes;
+static volatile unsigned long copy_bytes;
+
+void *malloc(size_t size)
+{
+  alloc_count++;
+  alloc_bytes += size;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+  alloc_count++;
+  alloc_bytes += count * size;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  alloc_count++;
+  alloc_bytes += size;
+  return __libc_realloc(ptr, size);
+}
+
+void *memmove(void *dest, const void *src, size_t length)
+{
+  // Volatile access keeps the compiler from turning the loops into calls
+  volatile char *d = (volatile char*) dest;
+  const char *s = (const char*) src;
+  size_t i;
+
+  copy_bytes += length;
+  if (d < s) {
+    for (i = 0; i < length; i++)
+      d[i] = s[i];
+  } else {
+    for (i = length; i > 0; i--)
+      d[i - 1] = s[i - 1];
+  }
+
+  return dest;
+}
+
+void *memcpy(void *dest, const void *src, size_t length)
+{
+  return memmove(dest, src, length);
+}
+
+static void alloc_count_dump(int signal)
+{
+  char buffer[128];
+  const char *path = getenv("ALLOC_COUNT_OUTPUT");
+  int fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDERR_FILENO;
+  if (fd < 0)
+    return;
+
+  int length = snprintf(buffer, sizeof(buffer), "%lu %lu %lu\n", alloc_count, alloc_bytes, copy_bytes);
+  write(fd, buffer, length);
+  if (fd != STDERR_FILENO)
+    close(fd);
+}
+
+static void alloc_count_reset(int signal)
+{
+  alloc_count = 0;
+  alloc_bytes = 0;
+  copy_bytes = 0;
+}
+
+__attribute__((constructor)) static void alloc_count_init(void)
+{
+  signal(ALLOC_COUNT_DUMP, alloc_count_dump);
+  signal(ALLOC_COUNT_RESET, alloc_count_reset);
+}
@@ -0,0 +1,120 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Collector parsing benchmark. Feeds synthetic status responses with
+ * 10 to 1000 keys through the collector and reports the cost per line,
+ * both for tokenizing with client_parse_response() alone and for the
+ * full collector_parse_response() including state output. The collector
+ * is included directly as its parser is internal to it.
+ */
+#include <time.h>
+
+#include "collector.c"
+
+/// Number of lines processed for each response size
+#define BENCH_LINES 2000000
+
+static double bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Generates a synthetic status response. Most lines are plain values,
+ * with some operator values and metadata lines mixed in.
+ *
+ * @param keys Number of keys
+ * @return Allocated response
+ */
+static char *bench_make_response(int keys)
+{
+  char *response = malloc(keys * 64 + 1);
+  size_t offset = 0;
+  int i;
+
+  response[0] = 0;
+  for (i = 0; i < keys; i++) {
+    int kind = i % 20;
+    if (kind == 0) {
+      offset += sprintf(response + offset, "%d: sn-%06d\n", i, i);
+    } else if (kind < 4) {
+      offset += sprintf(response + offset, "%d: %s: %d.%03d\n", i,
+        kind == 1 ? "max" : (kind == 2 ? "min" : "sum"), (i * 7) % 1000, i % 1000);
+    } else {
+      offset += sprintf(response + offset, "%d: %d.%03d\n", i, (i * 13) % 1000, (i * 31) % 1000);
+    }
+  }
+
+  return response;
+}
+
+int main(int argc, char **argv)
+{
+  struct collector_cfg_t cfg = { "environment.sensor%s.serial", "environment.sensor%s.temp", NULL };
+  FILE *state = fopen("/dev/null", "w");
+  gzFile log = gzopen("/dev/null", "w");
+  if (!state || !log) {
+    fprintf(stderr, "ERROR: Unable to open output files!\n");
+    return 1;
+  }
+
+  int sizes[] = { 10, 30, 100, 300, 1000 };
+  size_t s;
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int keys = sizes[s];
+    int iterations = BENCH_LINES / keys;
+    char *template = bench_make_response(keys);
+    size_t length = strlen(template) + 1;
+    struct collector_table_t table = { NULL, NULL, 0 };
+    struct client_response_t parsed;
+    client_response_init(&parsed);
+    int i;
+
+    // Parsed responses take over the buffer, so each one gets a copy
+    double start = bench_now();
+    for (i = 0; i < iterations; i++) {
+      char *response = malloc(length);
+      memcpy(response, template, length);
+      client_parse_response(response, &parsed);
+    }
+    double tokenize_ns = (bench_now() - start) / ((double) iterations * keys);
+
+    start = bench_now();
+    for (i = 0; i < iterations; i++) {
+      char *response = malloc(length);
+      memcpy(response, template, length);
+      client_parse_response(response, &parsed);
+      collector_parse_response(&cfg, &table, &parsed, log, state, NULL, NULL);
+    }
+    double collector_ns = (bench_now() - start) / ((double) iterations * keys);
+
+    printf("%5d keys: tokenize %7.1f ns/line, collector %7.1f ns/line\n", keys, tokenize_ns, collector_ns);
+
+    collector_table_reset(&table);
+    free(table.keys);
+    client_response_free(&parsed);
+    free(template);
+  }
+
+  gzclose(log);
+  fclose(state);
+  return 0;
+}
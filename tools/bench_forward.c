@@ -0,0 +1,218 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+/*
+ * Serial forwarding benchmark. Plays the device on the second end of the
+ * pty pair created by tools/dummy_serial.sh and answers every command with
+ * tools/test_response.txt, written in small chunks like a serial port
+ * would deliver it, while a client connection sends commands and reads
+ * the responses.
+ *
+ * When the server runs under tools/alloc_count.so, allocations and bytes
+ * copied by the server are reported for each response as well:
+ *
+ *   ALLOC_COUNT_OUTPUT=/tmp/alloc LD_PRELOAD=tools/alloc_count.so ./koruza-control -c test.cfg
+ *   ALLOC_COUNT_OUTPUT=/tmp/alloc tools/bench-forward test1 /tmp/koruza.sock $(pidof koruza-control)
+ */
+
+/// Response written by the device
+#define RESPONSE_FILE "tools/test_response.txt"
+/// Command sent for each response
+#define COMMAND "A 0\n"
+/// Number of responses before counters are cleared
+#define WARMUP 10
+
+static double bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Performs one transaction: sends the command, answers it on the device
+ * side and reads the complete response.
+ *
+ * @param device Device end of the pty pair
+ * @param client Connection to the server
+ * @param response Device response
+ * @param length Length of device response
+ * @param chunk Size of device writes
+ * @param received Number of bytes received by the client
+ * @return True on success, false when some error has ocurred
+ */
+bool bench_transaction(int device, int client, const char *response, size_t length, size_t chunk, size_t *received)
+{
+  if (write(client, COMMAND, strlen(COMMAND)) != (ssize_t) strlen(COMMAND))
+    return false;
+
+  // Wait for the command to reach the device
+  char c;
+  do {
+    if (read(device, &c, 1) != 1)
+      return false;
+  } while (c != '\n');
+
+  size_t offset;
+  for (offset = 0; offset < length; offset += chunk) {
+    size_t size = length - offset < chunk ? length - offset : chunk;
+    if (write(device, response + offset, size) != (ssize_t) size)
+      return false;
+  }
+
+  char buffer[4096];
+  size_t tail = 0;
+  char last[7] = {0,};
+  for (;;) {
+    ssize_t n = read(client, buffer, sizeof(buffer));
+    if (n <= 0)
+      return false;
+
+    *received += n;
+
+    // Keep the last bytes to detect the end of response across reads
+    ssize_t i;
+    for (i = 0; i < n; i++) {
+      memmove(last, last + 1, sizeof(last) - 1);
+      last[sizeof(last) - 1] = buffer[i];
+    }
+    tail += n;
+    if (tail >= sizeof(last) && memcmp(last, "#STOP\r\n", sizeof(last)) == 0)
+      return true;
+  }
+}
+
+/**
+ * Reads counters written by tools/alloc_count.so.
+ *
+ * @param pid Server process identifier
+ * @param counters Output allocation count, allocated bytes and copied bytes
+ * @return True on success, false when counters are not available
+ */
+bool bench_read_counters(pid_t pid, unsigned long counters[3])
+{
+  const char *path = getenv("ALLOC_COUNT_OUTPUT");
+  if (!path || kill(pid, SIGRTMIN + 1) < 0)
+    return false;
+
+  usleep(200000);
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return false;
+
+  bool ok = fscanf(file, "%lu %lu %lu", &counters[0], &counters[1], &counters[2]) == 3;
+  fclose(file);
+  return ok;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <device pty> <server socket> [server pid] [count] [chunk size]\n", argv[0]);
+    return 1;
+  }
+
+  pid_t pid = argc > 3 ? atoi(argv[3]) : 0;
+  int count = argc > 4 ? atoi(argv[4]) : 1000;
+  size_t chunk = argc > 5 ? atoi(argv[5]) : 7;
+  if (count <= 0 || chunk == 0) {
+    fprintf(stderr, "ERROR: Count and chunk size must be positive!\n");
+    return 1;
+  }
+
+  char response[4096];
+  FILE *file = fopen(RESPONSE_FILE, "r");
+  if (!file) {
+    fprintf(stderr, "ERROR: Unable to open '%s'!\n", RESPONSE_FILE);
+    return 1;
+  }
+  size_t length = fread(response, 1, sizeof(response), file);
+  fclose(file);
+
+  int device = open(argv[1], O_RDWR | O_NOCTTY);
+  if (device < 0) {
+    fprintf(stderr, "ERROR: Unable to open device '%s': %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  struct termios tio;
+  tcgetattr(device, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(device, TCSANOW, &tio);
+
+  int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, argv[2], sizeof(address.sun_path) - 1);
+  if (connect(client, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    fprintf(stderr, "ERROR: Unable to connect to '%s': %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+
+  size_t received = 0;
+  int i;
+  for (i = 0; i < WARMUP; i++) {
+    if (!bench_transaction(device, client, response, length, chunk, &received)) {
+      fprintf(stderr, "ERROR: Transaction failed!\n");
+      return 1;
+    }
+  }
+
+  if (pid > 0)
+    kill(pid, SIGRTMIN + 2);
+
+  received = 0;
+  double start = bench_now();
+  for (i = 0; i < count; i++) {
+    if (!bench_transaction(device, client, response, length, chunk, &received)) {
+      fprintf(stderr, "ERROR: Transaction failed!\n");
+      return 1;
+    }
+  }
+  double elapsed = bench_now() - start;
+
+  printf("%d responses of %zu bytes in %zu-byte device writes\n", count, length, chunk);
+  printf("  %.1f us per response, %.1f bytes received per response\n",
+    elapsed / count / 1000.0, (double) received / count);
+
+  unsigned long counters[3];
+  if (pid > 0 && bench_read_counters(pid, counters)) {
+    printf("  %.1f allocations, %.1f bytes allocated, %.1f bytes copied per response\n",
+      (double) counters[0] / count, (double) counters[1] / count, (double) counters[2] / count);
+  }
+
+  close(client);
+  close(device);
+  return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+ * Client response reader benchmark. A forked peer answers every command
+ * with tools/test_response.txt over a socket pair, while the client side
+ * calls client_send_device_command(). The binary is linked with read()
+ * and recv() wrapped, so the client's syscalls are counted.
+ */
+
+/// Response sent by the peer
+#define RESPONSE_FILE "tools/test_response.txt"
+/// Command sent for each response
+#define COMMAND "A 0\n"
+
+static unsigned long bench_reads;
+
+ssize_t __real_read(int fd, void *buffer, size_t length);
+ssize_t __real_recv(int fd, void *buffer, size_t length, int flags);
+
+ssize_t __wrap_read(int fd, void *buffer, size_t length)
+{
+  bench_reads++;
+  return __real_read(fd, buffer, length);
+}
+
+ssize_t __wrap_recv(int fd, void *buffer, size_t length, int flags)
+{
+  bench_reads++;
+  return __real_recv(fd, buffer, length, flags);
+}
+
+static double bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Answers count commands with the response.
+ *
+ * @param fd Peer end of the socket pair
+ * @param response Response
+ * @param length Length of response
+ * @param count Number of commands
+ */
+void bench_peer(int fd, const char *response, size_t length, int count)
+{
+  char command[64];
+  int i;
+  for (i = 0; i < count; i++) {
+    size_t received = 0;
+    while (received < strlen(COMMAND)) {
+      ssize_t n = __real_read(fd, command + received, strlen(COMMAND) - received);
+      if (n <= 0)
+        return;
+      received += n;
+    }
+
+    if (write(fd, response, length) != (ssize_t) length)
+      return;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int count = argc > 1 ? atoi(argv[1]) : 20000;
+  if (count <= 0) {
+    fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+    return 1;
+  }
+
+  char response[4096];
+  FILE *file = fopen(RESPONSE_FILE, "r");
+  if (!file) {
+    fprintf(stderr, "ERROR: Unable to open '%s'!\n", RESPONSE_FILE);
+    return 1;
+  }
+  size_t length = fread(response, 1, sizeof(response), file);
+  fclose(file);
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    fprintf(stderr, "ERROR: Unable to create socket pair!\n");
+    return 1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(sv[0]);
+    bench_peer(sv[1], response, length, count);
+    _exit(0);
+  }
+  close(sv[1]);
+
+  double start = bench_now();
+  int i;
+  for (i = 0; i < count; i++) {
+    char *body;
+    if (!client_send_device_command(sv[0], COMMAND, &body)) {
+      fprintf(stderr, "ERROR: Command failed!\n");
+      return 1;
+    }
+    free(body);
+  }
+  double elapsed = bench_now() - start;
+
+  printf("%d responses of %zu bytes\n", count, length);
+  printf("  %.1f read syscalls, %.0f ns per response\n", (double) bench_reads / count, elapsed / count);
+
+  close(sv[0]);
+  waitpid(pid, NULL, 0);
+  return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Simple KORUZA controller.
+ *
+ * Copyright (C) 2015 by Jernej Kos <kostko@irnas.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "client.h"
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Status snapshot benchmark. Compares the latency of reading the shared
+ * memory status snapshot with requesting the status from the server via
+ * client_request_device_state(). Requires a running server with the
+ * snapshot configured for the same command.
+ */
+
+static double bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <snapshot path> <server socket> [command] [count]\n", argv[0]);
+    return 1;
+  }
+
+  const char *command = argc > 3 ? argv[3] : "A 0\n";
+  int count = argc > 4 ? atoi(argv[4]) : 2000;
+  if (count <= 0) {
+    fprintf(stderr, "ERROR: Count must be positive!\n");
+    return 1;
+  }
+
+  struct snapshot_region_t *region = snapshot_open(argv[1]);
+  if (!region) {
+    fprintf(stderr, "ERROR: Unable to open snapshot '%s'!\n", argv[1]);
+    return 1;
+  }
+
+  int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, argv[2], sizeof(address.sun_path) - 1);
+  if (connect(client, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    fprintf(stderr, "ERROR: Unable to connect to '%s': %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+
+  // Reads are much cheaper, so take more of them for a stable figure
+  struct snapshot_data_t data;
+  int reads = count * 100;
+  int i;
+  double start = bench_now();
+  for (i = 0; i < reads; i++) {
+    if (!snapshot_read(region, &data)) {
+      fprintf(stderr, "ERROR: Snapshot read failed!\n");
+      return 1;
+    }
+  }
+  double snapshot_ns = (bench_now() - start) / reads;
+
+  // Requests print the state, which is not part of the comparison
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+
+  start = bench_now();
+  for (i = 0; i < count; i++) {
+    if (!client_request_device_state(client, command, false))
+      break;
+  }
+  double request_ns = (bench_now() - start) / count;
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(null_fd);
+  close(saved_stdout);
+
+  if (i < count) {
+    fprintf(stderr, "ERROR: Status request failed!\n");
+    return 1;
+  }
+
+  printf("snapshot with %u entries\n", data.count);
+  printf("  snapshot_read():                %10.0f ns per read\n", snapshot_ns);
+  printf("  client_request_device_state():  %10.0f ns per request\n", request_ns);
+
+  close(client);
+  snapshot_close(region);
+  return 0;
+}
@@ -28,7 +28,17 @@ utimer_t timer_now()
     fprintf(stderr, "ERROR: Failed to get monotonic clock, weird things may happen!");
     return -1;
   }
-  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  return (utimer_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+utimer_t timer_now_usec()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+    fprintf(stderr, "ERROR: Failed to get monotonic clock, weird things may happen!");
+    return -1;
+  }
+  return (utimer_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 int is_timeout(utimer_t *timer, utimer_t period)
@@ -22,6 +22,7 @@
 typedef unsigned long long utimer_t;
 
 utimer_t timer_now();
+utimer_t timer_now_usec();
 int is_timeout(utimer_t *timer, utimer_t period);
 
 #endif